@@ -0,0 +1,196 @@
+#include "cachebudget_p.h"
+#include "cgroup.h"
+#include <QFile>
+#include <QLoggingCategory>
+#include <QSocketNotifier>
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+Q_LOGGING_CATEGORY(lcBudget, "speedyimage.budget")
+
+// Limits of the budget sized from available memory
+static const qint64 minimumBudget = 16 * 1048576;
+static const qint64 maximumBudget = 2048LL * 1048576;
+// Budget when available memory is unknown
+static const qint64 defaultBudget = 128 * 1048576;
+
+// Pressure is reported for 300ms of stalls within any 2 seconds. Unprivileged processes can
+// only create triggers with a window of at least 2 seconds.
+static const char pressureTrigger[] = "some 300000 2000000";
+static const qreal minimumPressureScale = 1.0 / 16;
+// Pressure must be gone this long before the budget grows again
+static const int pressureRecoveryMs = 10000;
+static const int updateIntervalMs = 5000;
+
+CacheBudget *CacheBudget::instance()
+{
+    static CacheBudget *budget = new CacheBudget;
+    return budget;
+}
+
+CacheBudget::CacheBudget()
+    : d(new CacheBudgetPrivate(this))
+{
+}
+
+CacheBudget::~CacheBudget()
+{
+}
+
+qint64 CacheBudget::budget() const
+{
+    return d->budget.loadAcquire();
+}
+
+bool CacheBudget::underPressure() const
+{
+    return d->pressureScale < 1;
+}
+
+CacheBudgetPrivate::CacheBudgetPrivate(CacheBudget *q)
+    : q(q)
+    , fixedBudget(qgetenv("SPEEDYIMAGE_CACHE_SIZE").toLongLong())
+    , budget(0)
+    , pressureScale(1)
+    , pressureFd(-1)
+    , pressureNotifier(nullptr)
+{
+    if (fixedBudget < 1)
+        fixedBudget = 0;
+    if (!readCgroupFile(currentCgroupPath(), QStringLiteral("memory.max")).isEmpty())
+        cgroupPath = currentCgroupPath();
+    openPressure();
+
+    connect(&timer, &QTimer::timeout, this, &CacheBudgetPrivate::update);
+    timer.start(updateIntervalMs);
+    update();
+}
+
+CacheBudgetPrivate::~CacheBudgetPrivate()
+{
+#ifdef Q_OS_LINUX
+    if (pressureFd >= 0)
+        ::close(pressureFd);
+#endif
+}
+
+// Read a single number from a cgroup file, or -1 if it's missing or unlimited
+qint64 CacheBudgetPrivate::readNumber(const QString &cgroup, const QString &name)
+{
+    bool ok = false;
+    qint64 value = readCgroupFile(cgroup, name).toLongLong(&ok);
+    return ok ? value : -1;
+}
+
+// Values of /proc/meminfo in bytes
+QHash<QByteArray,qint64> CacheBudgetPrivate::readMeminfo()
+{
+    QHash<QByteArray,qint64> values;
+    QFile file(QStringLiteral("/proc/meminfo"));
+    if (!file.open(QIODevice::ReadOnly))
+        return values;
+
+    const QList<QByteArray> lines = file.readAll().split('\n');
+    for (const QByteArray &line : lines) {
+        int colon = line.indexOf(':');
+        if (colon < 0)
+            continue;
+        QList<QByteArray> value = line.mid(colon + 1).simplified().split(' ');
+        qint64 number = value.value(0).toLongLong();
+        if (value.value(1) == "kB")
+            number *= 1024;
+        values.insert(line.left(colon), number);
+    }
+    return values;
+}
+
+// Register a PSI trigger for the cgroup, or for the whole system. The kernel signals the
+// file with POLLPRI for each event, which QSocketNotifier reports as an exception.
+void CacheBudgetPrivate::openPressure()
+{
+#ifdef Q_OS_LINUX
+    QStringList candidates;
+    if (!cgroupPath.isEmpty())
+        candidates << cgroupPath + QStringLiteral("/memory.pressure");
+    candidates << QStringLiteral("/proc/pressure/memory");
+
+    for (const QString &fileName : candidates) {
+        int fd = ::open(QFile::encodeName(fileName).constData(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        if (::write(fd, pressureTrigger, sizeof(pressureTrigger)) < 0) {
+            ::close(fd);
+            continue;
+        }
+
+        qCDebug(lcBudget) << "watching memory pressure from" << fileName;
+        pressureFd = fd;
+        pressureNotifier = new QSocketNotifier(fd, QSocketNotifier::Exception, this);
+        connect(pressureNotifier, &QSocketNotifier::activated, this, &CacheBudgetPrivate::pressureEvent);
+        return;
+    }
+    qCDebug(lcBudget) << "memory pressure is not available";
+#endif
+}
+
+// Budget before any reduction for pressure
+qint64 CacheBudgetPrivate::availableBudget() const
+{
+    if (fixedBudget)
+        return fixedBudget;
+
+    auto meminfo = readMeminfo();
+    qint64 total = meminfo.value("MemTotal", -1);
+    qint64 available = meminfo.value("MemAvailable", -1);
+
+    if (!cgroupPath.isEmpty()) {
+        qint64 max = readNumber(cgroupPath, QStringLiteral("memory.max"));
+        qint64 current = readNumber(cgroupPath, QStringLiteral("memory.current"));
+        if (max > 0) {
+            total = total > 0 ? qMin(total, max) : max;
+            if (current >= 0)
+                available = available >= 0 ? qMin(available, max - current) : max - current;
+        }
+    }
+
+    if (total <= 0)
+        return defaultBudget;
+
+    qint64 value = total / 16;
+    if (available >= 0)
+        value = qMin(value, available / 2);
+    return qBound(minimumBudget, value, maximumBudget);
+}
+
+void CacheBudgetPrivate::update()
+{
+    bool wasUnderPressure = pressureScale < 1;
+    if (wasUnderPressure && sincePressure.elapsed() >= pressureRecoveryMs)
+        pressureScale = qMin<qreal>(1, pressureScale * 1.5);
+
+    qint64 value = qint64(availableBudget() * pressureScale);
+    if (value != budget.loadAcquire()) {
+        qCDebug(lcBudget) << "cache budget is" << value << "at pressure scale" << pressureScale;
+        budget.storeRelease(value);
+        emit q->budgetChanged(value);
+    }
+    if (wasUnderPressure != (pressureScale < 1))
+        emit q->underPressureChanged();
+}
+
+void CacheBudgetPrivate::pressureEvent()
+{
+    bool wasUnderPressure = pressureScale < 1;
+    pressureScale = qMax(minimumPressureScale, pressureScale / 2);
+    sincePressure.restart();
+    qCDebug(lcBudget) << "memory pressure, reducing cache budget to scale" << pressureScale;
+
+    qint64 value = qint64(availableBudget() * pressureScale);
+    budget.storeRelease(value);
+    emit q->budgetChanged(value);
+    if (!wasUnderPressure)
+        emit q->underPressureChanged();
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <QObject>
+#include <memory>
+
+class CacheBudgetPrivate;
+
+// CacheBudget decides how many bytes of textures each ImageTextureCache may keep, and
+// DecodedImageCache uses a quarter of that unless its size is set explicitly.
+//
+// The budget is a sixteenth of the memory available to the process, which is the
+// smaller of MemTotal in /proc/meminfo and memory.max of its cgroup, and at most half of
+// the memory still free. SPEEDYIMAGE_CACHE_SIZE sets a fixed budget in bytes instead.
+//
+// When the kernel reports memory pressure through PSI, the budget is halved for each
+// event, down to a sixteenth. It grows back gradually once pressure has been gone for a
+// while. The current budget is available to QML as the CacheBudget singleton.
+class CacheBudget : public QObject
+{
+    Q_OBJECT
+    Q_PROPERTY(qint64 budget READ budget NOTIFY budgetChanged)
+    Q_PROPERTY(bool underPressure READ underPressure NOTIFY underPressureChanged)
+
+public:
+    // Only valid on GUI thread
+    static CacheBudget *instance();
+
+    virtual ~CacheBudget();
+
+    // May be called from any thread
+    qint64 budget() const;
+
+    bool underPressure() const;
+
+signals:
+    void budgetChanged(qint64 budget);
+    void underPressureChanged();
+
+private:
+    friend class CacheBudgetPrivate;
+    std::unique_ptr<CacheBudgetPrivate> d;
+
+    CacheBudget();
+};
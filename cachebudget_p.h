@@ -0,0 +1,44 @@
+#pragma once
+
+#include "cachebudget.h"
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QTimer>
+
+class QSocketNotifier;
+
+class CacheBudgetPrivate : public QObject
+{
+    Q_OBJECT
+
+public:
+    CacheBudget *q;
+
+    // Budget set by SPEEDYIMAGE_CACHE_SIZE, or 0 to size it from available memory
+    qint64 fixedBudget;
+    QAtomicInteger<qint64> budget;
+
+    // Fraction of the budget left after memory pressure
+    qreal pressureScale;
+    QElapsedTimer sincePressure;
+
+    // Directory of the process's cgroup v2, if it has the memory controller
+    QString cgroupPath;
+    int pressureFd;
+    QSocketNotifier *pressureNotifier;
+    QTimer timer;
+
+    CacheBudgetPrivate(CacheBudget *q);
+    ~CacheBudgetPrivate();
+
+    static qint64 readNumber(const QString &cgroup, const QString &name);
+    static QHash<QByteArray,qint64> readMeminfo();
+
+    void openPressure();
+    qint64 availableBudget() const;
+
+public slots:
+    void update();
+    void pressureEvent();
+};
@@ -0,0 +1,32 @@
+#include "cgroup.h"
+#include <QFile>
+
+QString currentCgroupPath()
+{
+    static const QString path = []() -> QString {
+        QFile file(QStringLiteral("/proc/self/cgroup"));
+        if (!file.open(QIODevice::ReadOnly))
+            return QString();
+
+        const QList<QByteArray> lines = file.readAll().split('\n');
+        for (const QByteArray &line : lines) {
+            if (line.startsWith("0::")) {
+                QString path = QStringLiteral("/sys/fs/cgroup") + QString::fromLocal8Bit(line.mid(3)).trimmed();
+                if (QFile::exists(path + QStringLiteral("/cgroup.controllers")))
+                    return path;
+            }
+        }
+        return QString();
+    }();
+    return path;
+}
+
+QByteArray readCgroupFile(const QString &cgroup, const QString &name)
+{
+    if (cgroup.isEmpty())
+        return QByteArray();
+    QFile file(cgroup + QLatin1Char('/') + name);
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+    return file.readAll().trimmed();
+}
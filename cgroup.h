@@ -0,0 +1,11 @@
+#pragma once
+
+#include <QByteArray>
+#include <QString>
+
+// Directory of the cgroup v2 of this process under /sys/fs/cgroup, from the "0::" line of
+// /proc/self/cgroup, or an empty string if there is none
+QString currentCgroupPath();
+
+// Contents of a cgroup file, or an empty string if it can't be read
+QByteArray readCgroupFile(const QString &cgroup, const QString &name);
@@ -0,0 +1,122 @@
+#include "decodedimagecache_p.h"
+#include "cachebudget.h"
+#include <QLoggingCategory>
+
+Q_LOGGING_CATEGORY(lcImageCache, "speedyimage.imagecache")
+
+DecodedImageCache *DecodedImageCache::instance()
+{
+    static DecodedImageCache *cache = []() -> DecodedImageCache* {
+        if (qEnvironmentVariableIsSet("SPEEDYIMAGE_CPU_CACHE_SIZE")) {
+            qint64 maxSize = qgetenv("SPEEDYIMAGE_CPU_CACHE_SIZE").toLongLong();
+            qCDebug(lcImageCache) << "using decoded image cache with size" << maxSize;
+            return new DecodedImageCache(maxSize);
+        }
+
+        CacheBudget *budget = CacheBudget::instance();
+        auto cache = new DecodedImageCache(budget->budget() / 4);
+        QObject::connect(budget, &CacheBudget::budgetChanged, budget, [cache](qint64 value) { cache->setMaxSize(value / 4); });
+        qCDebug(lcImageCache) << "using decoded image cache with size" << cache->maxSize() << "from budget";
+        return cache;
+    }();
+    return cache;
+}
+
+DecodedImageCache::DecodedImageCache(qint64 maxSize)
+    : d(new DecodedImageCachePrivate(qMax(maxSize, qint64(0))))
+{
+}
+
+DecodedImageCache::~DecodedImageCache()
+{
+}
+
+DecodedImageCachePrivate::DecodedImageCachePrivate(qint64 maxSize)
+    : maxSize(maxSize)
+    , totalSize(0)
+{
+}
+
+qint64 DecodedImageCache::maxSize() const
+{
+    QMutexLocker l(&d->mutex);
+    return d->maxSize;
+}
+
+void DecodedImageCache::setMaxSize(qint64 maxSize)
+{
+    QMutexLocker l(&d->mutex);
+    d->maxSize = qMax(maxSize, qint64(0));
+    d->evict();
+}
+
+qint64 DecodedImageCache::size() const
+{
+    QMutexLocker l(&d->mutex);
+    return d->totalSize;
+}
+
+qint64 DecodedImageCachePrivate::imageBytes(const QImage &image)
+{
+    return qint64(image.bytesPerLine()) * image.height();
+}
+
+bool DecodedImageCache::lookup(const QString &key, QImage &image, QSize &imageSize)
+{
+    QMutexLocker l(&d->mutex);
+    auto it = d->entries.find(key);
+    if (it == d->entries.end())
+        return false;
+
+    d->lru.splice(d->lru.end(), d->lru, it->lruPos);
+    image = it->image;
+    imageSize = it->imageSize;
+    return true;
+}
+
+void DecodedImageCache::insert(const QString &key, const QImage &image, const QSize &imageSize)
+{
+    qint64 size = DecodedImageCachePrivate::imageBytes(image);
+    QMutexLocker l(&d->mutex);
+    if (image.isNull() || size > d->maxSize)
+        return;
+
+    auto it = d->entries.find(key);
+    if (it != d->entries.end())
+        d->removeEntry(it);
+
+    d->lru.push_back(key);
+    d->entries.insert(key, DecodedImageCachePrivate::Entry{image, imageSize, size, std::prev(d->lru.end())});
+    d->totalSize += size;
+    d->evict();
+}
+
+void DecodedImageCache::remove(const QString &key)
+{
+    QMutexLocker l(&d->mutex);
+    auto it = d->entries.find(key);
+    if (it != d->entries.end())
+        d->removeEntry(it);
+}
+
+// Must hold mutex
+void DecodedImageCachePrivate::removeEntry(QHash<QString,Entry>::iterator it)
+{
+    totalSize -= it->size;
+    lru.erase(it->lruPos);
+    entries.erase(it);
+}
+
+// Must hold mutex
+void DecodedImageCachePrivate::evict()
+{
+    if (totalSize <= maxSize)
+        return;
+
+    int count = 0;
+    while (totalSize > maxSize && !lru.empty()) {
+        removeEntry(entries.find(lru.front()));
+        count++;
+    }
+    qCDebug(lcImageCache) << "evicted" << count << "images, using" << totalSize << "of" << maxSize;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <QImage>
+#include <QString>
+#include <memory>
+
+class DecodedImageCachePrivate;
+
+// DecodedImageCache holds decoded images in memory, so that an image can be uploaded
+// again after its texture was evicted, or uploaded to another window, without decoding
+// the source again. Entries are evicted in least recently used order when the cache
+// exceeds its size in bytes.
+//
+// The cache is shared by all windows in the process, and its size is set in bytes by
+// SPEEDYIMAGE_CPU_CACHE_SIZE. Otherwise, it follows a quarter of the CacheBudget. A size
+// of zero disables the cache.
+//
+// All functions are thread-safe.
+class DecodedImageCache
+{
+public:
+    static DecodedImageCache *instance();
+
+    explicit DecodedImageCache(qint64 maxSize);
+    ~DecodedImageCache();
+
+    bool isEnabled() const { return maxSize() > 0; }
+
+    bool lookup(const QString &key, QImage &image, QSize &imageSize);
+    void insert(const QString &key, const QImage &image, const QSize &imageSize);
+    void remove(const QString &key);
+
+    qint64 maxSize() const;
+    void setMaxSize(qint64 maxSize);
+    qint64 size() const;
+
+private:
+    std::unique_ptr<DecodedImageCachePrivate> d;
+};
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "decodedimagecache.h"
+#include <QHash>
+#include <QMutex>
+#include <list>
+
+class DecodedImageCachePrivate
+{
+public:
+    struct Entry
+    {
+        QImage image;
+        QSize imageSize;
+        qint64 size;
+        // Position in lru
+        std::list<QString>::iterator lruPos;
+    };
+
+    DecodedImageCachePrivate(qint64 maxSize);
+
+    // Protects everything below
+    QMutex mutex;
+    qint64 maxSize;
+    QHash<QString,Entry> entries;
+    // Keys in order of use, least recently used first
+    std::list<QString> lru;
+    qint64 totalSize;
+
+    static qint64 imageBytes(const QImage &image);
+
+    void removeEntry(QHash<QString,Entry>::iterator it);
+    void evict();
+};
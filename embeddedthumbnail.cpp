@@ -0,0 +1,171 @@
+#include "embeddedthumbnail.h"
+#include <QLoggingCategory>
+
+Q_DECLARE_LOGGING_CATEGORY(lcImageLoad)
+
+namespace {
+
+// Bounds-checked reads from a TIFF structure with either byte order
+class TiffReader
+{
+public:
+    TiffReader(const uchar *data, int size)
+        : data(data)
+        , size(size)
+        , bigEndian(false)
+    {
+    }
+
+    const uchar *data;
+    int size;
+    bool bigEndian;
+
+    bool u16(int offset, quint16 &value) const
+    {
+        if (offset < 0 || offset + 2 > size)
+            return false;
+        const uchar *p = data + offset;
+        value = bigEndian ? quint16((p[0] << 8) | p[1]) : quint16((p[1] << 8) | p[0]);
+        return true;
+    }
+
+    bool u32(int offset, quint32 &value) const
+    {
+        if (offset < 0 || offset + 4 > size)
+            return false;
+        const uchar *p = data + offset;
+        if (bigEndian)
+            value = (quint32(p[0]) << 24) | (quint32(p[1]) << 16) | (quint32(p[2]) << 8) | quint32(p[3]);
+        else
+            value = (quint32(p[3]) << 24) | (quint32(p[2]) << 16) | (quint32(p[1]) << 8) | quint32(p[0]);
+        return true;
+    }
+
+    // Value of a SHORT or LONG tag in the IFD at offset
+    bool tag(int ifd, quint16 id, quint32 &value) const
+    {
+        quint16 count;
+        if (!u16(ifd, count))
+            return false;
+        for (int i = 0; i < count; i++) {
+            int entry = ifd + 2 + i * 12;
+            quint16 entryId, type;
+            if (!u16(entry, entryId) || !u16(entry + 2, type))
+                return false;
+            if (entryId != id)
+                continue;
+            if (type == 3) {
+                quint16 v;
+                if (!u16(entry + 8, v))
+                    return false;
+                value = v;
+                return true;
+            } else if (type == 4) {
+                return u32(entry + 8, value);
+            }
+            return false;
+        }
+        return false;
+    }
+
+    // Offset of the IFD following the IFD at offset, or 0
+    quint32 nextIfd(int ifd) const
+    {
+        quint16 count;
+        quint32 next = 0;
+        if (!u16(ifd, count) || !u32(ifd + 2 + count * 12, next))
+            return 0;
+        return next;
+    }
+};
+
+QImage exifThumbnail(const uchar *data, int size)
+{
+    // TIFF header after "Exif\0\0"
+    if (size < 14 || memcmp(data, "Exif\0\0", 6) != 0)
+        return QImage();
+    TiffReader tiff(data + 6, size - 6);
+    if (memcmp(tiff.data, "MM", 2) == 0)
+        tiff.bigEndian = true;
+    else if (memcmp(tiff.data, "II", 2) != 0)
+        return QImage();
+
+    quint32 ifd0 = 0;
+    if (!tiff.u32(4, ifd0) || ifd0 >= quint32(tiff.size))
+        return QImage();
+    // The thumbnail is described in IFD1, which follows IFD0
+    quint32 ifd1 = tiff.nextIfd(int(ifd0));
+    if (!ifd1 || ifd1 >= quint32(tiff.size))
+        return QImage();
+
+    quint32 offset = 0, length = 0;
+    if (!tiff.tag(int(ifd1), 0x0201, offset) || !tiff.tag(int(ifd1), 0x0202, length) || !length ||
+        quint64(offset) + length > quint64(tiff.size))
+    {
+        return QImage();
+    }
+
+    return QImage::fromData(tiff.data + offset, int(length), "JPEG");
+}
+
+QImage jfifThumbnail(const uchar *data, int size)
+{
+    if (size >= 14 && memcmp(data, "JFIF\0", 5) == 0) {
+        // Uncompressed RGB thumbnail following the density fields
+        int width = data[12], height = data[13];
+        if (!width || !height || 14 + width * height * 3 > size)
+            return QImage();
+        QImage image(width, height, QImage::Format_RGB888);
+        for (int y = 0; y < height; y++)
+            memcpy(image.scanLine(y), data + 14 + y * width * 3, size_t(width) * 3);
+        return image;
+    } else if (size > 6 && memcmp(data, "JFXX\0", 5) == 0 && data[5] == 0x10) {
+        // JPEG thumbnail extension
+        return QImage::fromData(data + 6, size - 6, "JPEG");
+    }
+    return QImage();
+}
+
+} // namespace
+
+QImage readEmbeddedThumbnail(const QByteArray &bytes)
+{
+    const uchar *data = reinterpret_cast<const uchar*>(bytes.constData());
+    int size = bytes.size();
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+        return QImage();
+
+    // Walk markers until the start of scan, looking at APP0 and APP1 segments
+    int pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF)
+            break;
+        uchar marker = data[pos + 1];
+        if (marker == 0xFF) {
+            pos++;
+            continue;
+        }
+        if (marker == 0xDA || marker == 0xD9)
+            break;
+
+        int length = (data[pos + 2] << 8) | data[pos + 3];
+        if (length < 2 || pos + 2 + length > size)
+            break;
+        const uchar *segment = data + pos + 4;
+        int segmentSize = length - 2;
+
+        QImage image;
+        if (marker == 0xE1)
+            image = exifThumbnail(segment, segmentSize);
+        else if (marker == 0xE0)
+            image = jfifThumbnail(segment, segmentSize);
+        if (!image.isNull()) {
+            qCDebug(lcImageLoad) << "found embedded thumbnail of" << image.size();
+            return image;
+        }
+
+        pos += 2 + length;
+    }
+
+    return QImage();
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <QByteArray>
+#include <QImage>
+
+// Maximum number of bytes from the start of a file that are needed to find an
+// embedded thumbnail.
+static const int embeddedThumbnailSearchSize = 128 * 1024;
+
+// Decode the thumbnail embedded in the EXIF or JFIF headers of JPEG data, which only
+// needs the first embeddedThumbnailSearchSize bytes of the file. Returns a null image
+// if there is no thumbnail. Orientation is not applied.
+QImage readEmbeddedThumbnail(const QByteArray &data);
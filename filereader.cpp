@@ -0,0 +1,640 @@
+#include "filereader_p.h"
+#include <QFile>
+#include <QLoggingCategory>
+#include <climits>
+#include <cstring>
+#include <thread>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef Q_OS_LINUX
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#endif
+#ifdef SPEEDYIMAGE_HAVE_IO_URING
+#include <atomic>
+#include <cerrno>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+Q_LOGGING_CATEGORY(lcFileReader, "speedyimage.io")
+
+// Files are read whole, so anything larger is not an image worth loading
+static const qint64 maximumFileSize = INT_MAX - 4096;
+
+FileReader *FileReader::instance()
+{
+    static FileReader *reader = new FileReader;
+    return reader;
+}
+
+FileReader::FileReader()
+    : d(new FileReaderPrivate)
+{
+}
+
+FileReader::~FileReader()
+{
+}
+
+FileRead FileReader::read(const QString &path, bool urgent)
+{
+    QMutexLocker l(&d->mutex);
+
+    // Share a read that is in progress or succeeded, and hurry it up if it hasn't started
+    auto read = d->reads.value(path).lock();
+    if (read && (!read->finished || read->error.isEmpty())) {
+        if (urgent && !read->finished) {
+            for (auto it = d->requests.begin(); it != d->requests.end(); it++) {
+                if (it->lock() == read) {
+                    d->requests.erase(it);
+                    d->requests.push_front(read);
+                    break;
+                }
+            }
+        }
+        return FileRead(read);
+    }
+
+    read = std::make_shared<FileReadData>();
+    read->reader = d.get();
+    read->path = path;
+    d->reads.insert(path, read);
+    if (d->reads.size() > 2 * d->sweptReads + 64) {
+        for (auto it = d->reads.begin(); it != d->reads.end(); ) {
+            if (it->expired())
+                it = d->reads.erase(it);
+            else
+                it++;
+        }
+        d->sweptReads = d->reads.size();
+    }
+
+    if (urgent)
+        d->requests.push_front(read);
+    else
+        d->requests.push_back(read);
+
+#ifdef SPEEDYIMAGE_HAVE_IO_URING
+    // Woken with the mutex held, because the ring is closed if it fails
+    if (d->ringFd >= 0) {
+        d->wake();
+        return FileRead(read);
+    }
+#endif
+    d->startThreads();
+    l.unlock();
+    d->requestsCv.wakeOne();
+    return FileRead(read);
+}
+
+QString FileRead::path() const
+{
+    return d ? d->path : QString();
+}
+
+bool FileRead::isFinished() const
+{
+    if (!d)
+        return false;
+    QMutexLocker l(&d->reader->mutex);
+    return d->finished;
+}
+
+QByteArray FileRead::wait(QString *error) const
+{
+    if (!d)
+        return QByteArray();
+
+    QMutexLocker l(&d->reader->mutex);
+    while (!d->finished)
+        d->reader->readFinished.wait(&d->reader->mutex);
+    if (error)
+        *error = d->error;
+    return d->data;
+}
+
+FileReaderPrivate::FileReaderPrivate()
+    : depth(qgetenv("SPEEDYIMAGE_IO_DEPTH").toInt())
+    , sweptReads(0)
+    , mapFiles(qgetenv("SPEEDYIMAGE_MMAP") == "1")
+    , threadCount(0)
+    , idleThreads(0)
+#ifdef SPEEDYIMAGE_HAVE_IO_URING
+    , ringFd(-1)
+    , ringEntries(0)
+    , sqRing(MAP_FAILED)
+    , sqRingSize(0)
+    , cqRing(MAP_FAILED)
+    , cqRingSize(0)
+    , sqes(nullptr)
+    , sqesSize(0)
+    , unsubmitted(0)
+    , wakeFd(-1)
+    , wakeValue(0)
+    , inFlight(0)
+#endif
+{
+    if (depth < 1 || depth > 1024)
+        depth = 16;
+
+#ifdef SPEEDYIMAGE_HAVE_IO_URING
+    if (qgetenv("SPEEDYIMAGE_IO_URING") != "0" && setupRing()) {
+        qCDebug(lcFileReader) << "reading files with io_uring at depth" << depth;
+        std::thread(&FileReaderPrivate::uringThread, this).detach();
+        return;
+    }
+#endif
+    qCDebug(lcFileReader) << "reading files with up to" << depth << "threads";
+}
+
+// The reader is never destroyed while its threads are running
+FileReaderPrivate::~FileReaderPrivate()
+{
+#ifdef SPEEDYIMAGE_HAVE_IO_URING
+    closeRing();
+#endif
+}
+
+FileMapping::~FileMapping()
+{
+#ifdef Q_OS_UNIX
+    ::munmap(data, length);
+#endif
+}
+
+// Network filesystems are read rather than mapped, because page faults on the mapping would
+// block decoders on the network. The answer is kept for each device.
+bool FileReaderPrivate::isLocal(int fd, quint64 device)
+{
+#ifdef Q_OS_LINUX
+    QMutexLocker l(&mutex);
+    auto it = localDevices.constFind(device);
+    if (it != localDevices.constEnd())
+        return *it;
+    l.unlock();
+
+    static const quint32 networkTypes[] = {
+        0x6969,     // NFS
+        0xff534d42, // CIFS
+        0xfe534d42, // SMB2
+        0x517b,     // SMB
+        0x65735546, // FUSE
+        0x01021997, // 9P
+        0x00c36400, // Ceph
+        0x47504653, // GPFS
+        0x0bd00bd0, // Lustre
+        0x013111a8, // IBRIX
+        0x7461636f, // OCFS2
+        0x564c,     // NCP
+        0xbeefdead, // AFS
+        0x5346414f  // OpenAFS
+    };
+    struct statfs fs;
+    bool local = false;
+    if (fstatfs(fd, &fs) == 0) {
+        local = true;
+        for (quint32 type : networkTypes) {
+            if (quint32(fs.f_type) == type)
+                local = false;
+        }
+    }
+
+    l.relock();
+    localDevices.insert(device, local);
+    qCDebug(lcFileReader) << "device" << device << (local ? "is local, mapping files" : "is not local, reading files");
+    return local;
+#else
+    Q_UNUSED(fd);
+    Q_UNUSED(device);
+    return true;
+#endif
+}
+
+std::shared_ptr<FileMapping> FileReaderPrivate::mapFile(int fd, qint64 size)
+{
+#ifdef Q_OS_UNIX
+    void *data = ::mmap(nullptr, size_t(size), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return nullptr;
+
+    // Decoders go through the file from start to end, so have the kernel read it ahead
+    ::madvise(data, size_t(size), MADV_SEQUENTIAL);
+    ::madvise(data, size_t(size), MADV_WILLNEED);
+
+    auto mapping = std::make_shared<FileMapping>();
+    mapping->data = static_cast<uchar*>(data);
+    mapping->length = size_t(size);
+    return mapping;
+#else
+    Q_UNUSED(fd);
+    Q_UNUSED(size);
+    return nullptr;
+#endif
+}
+
+// Must be called with the mutex held. The data of the read is only replaced once.
+void FileReaderPrivate::finish(FileReadData *read, const QByteArray &data, const QString &error,
+                               const std::shared_ptr<FileMapping> &mapping)
+{
+    read->mapping = mapping;
+    if (mapping)
+        read->data = QByteArray::fromRawData(reinterpret_cast<const char*>(mapping->data), int(mapping->length));
+    else
+        read->data = data;
+    read->error = error;
+    read->finished = true;
+    if (!error.isEmpty())
+        qCDebug(lcFileReader) << "cannot read" << read->path << error;
+    readFinished.wakeAll();
+}
+
+// Must be called with the mutex held
+void FileReaderPrivate::startThreads()
+{
+    while (threadCount < depth && int(requests.size()) > idleThreads) {
+        threadCount++;
+        idleThreads++;
+        std::thread(&FileReaderPrivate::poolThread, this).detach();
+    }
+}
+
+void FileReaderPrivate::poolThread()
+{
+    QMutexLocker l(&mutex);
+    for (;;) {
+        while (requests.empty())
+            requestsCv.wait(&mutex);
+        auto read = requests.front().lock();
+        requests.pop_front();
+        if (!read)
+            continue;
+
+        idleThreads--;
+        l.unlock();
+        QString error;
+        std::shared_ptr<FileMapping> mapping;
+        QByteArray data = readFile(read->path, error, mapping);
+        l.relock();
+        idleThreads++;
+        finish(read.get(), data, error, mapping);
+    }
+}
+
+QByteArray FileReaderPrivate::readFile(const QString &path, QString &error, std::shared_ptr<FileMapping> &mapping)
+{
+#ifdef Q_OS_UNIX
+    if (mapFiles) {
+        int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            struct stat st;
+            if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size <= maximumFileSize && isLocal(fd, quint64(st.st_dev)))
+                mapping = mapFile(fd, st.st_size);
+            ::close(fd);
+            if (mapping)
+                return QByteArray();
+        }
+    }
+#endif
+
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        error = file.errorString();
+        return QByteArray();
+    }
+    if (file.size() > maximumFileSize) {
+        error = QStringLiteral("File is too large");
+        return QByteArray();
+    }
+
+    QByteArray data = file.readAll();
+    if (file.error() != QFileDevice::NoError) {
+        error = file.errorString();
+        return QByteArray();
+    }
+    if (data.isEmpty()) {
+        error = QStringLiteral("File is empty");
+        return QByteArray();
+    }
+    return data;
+}
+
+#ifdef SPEEDYIMAGE_HAVE_IO_URING
+// The rings are used through the system calls directly, rather than adding a dependency on
+// liburing. Only the io_uring thread touches them after setup.
+
+static int ioUringSetup(unsigned entries, io_uring_params *params)
+{
+    return int(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int ioUringEnter(int fd, unsigned submit, unsigned minComplete, unsigned flags)
+{
+    return int(syscall(__NR_io_uring_enter, fd, submit, minComplete, flags, nullptr, 0));
+}
+
+static int ioUringRegister(int fd, unsigned opcode, void *arg, unsigned count)
+{
+    return int(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+}
+
+static unsigned loadAcquire(const unsigned *p)
+{
+    return reinterpret_cast<const std::atomic<unsigned>*>(p)->load(std::memory_order_acquire);
+}
+
+static void storeRelease(unsigned *p, unsigned value)
+{
+    reinterpret_cast<std::atomic<unsigned>*>(p)->store(value, std::memory_order_release);
+}
+
+// Returns false if io_uring is missing, blocked (as in many containers), or too old to
+// open, statx and read files.
+bool FileReaderPrivate::setupRing()
+{
+    // Each file has at most two operations in flight, plus the read of wakeFd
+    ringEntries = 1;
+    while (ringEntries < unsigned(depth) * 2 + 1)
+        ringEntries <<= 1;
+
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd = ioUringSetup(ringEntries, &params);
+    if (ringFd < 0) {
+        qCDebug(lcFileReader) << "io_uring is not available:" << qt_error_string(errno);
+        return false;
+    }
+
+    const size_t probeSize = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+    auto probe = static_cast<io_uring_probe*>(calloc(1, probeSize));
+    bool supported = ioUringRegister(ringFd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (unsigned op : { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ }) {
+        if (!supported || op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+            supported = false;
+    }
+    free(probe);
+    if (!supported) {
+        qCDebug(lcFileReader) << "io_uring does not support reading files";
+        closeRing();
+        return false;
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sqRingSize = cqRingSize = qMax(sqRingSize, cqRingSize);
+
+    sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        cqRing = sqRing;
+    else
+        cqRing = mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    void *sqesMap = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    sqes = sqesMap == MAP_FAILED ? nullptr : static_cast<io_uring_sqe*>(sqesMap);
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || !sqes || wakeFd < 0) {
+        qCDebug(lcFileReader) << "cannot set up io_uring:" << qt_error_string(errno);
+        closeRing();
+        return false;
+    }
+
+    auto sq = static_cast<char*>(sqRing);
+    auto cq = static_cast<char*>(cqRing);
+    sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    ringEntries = params.sq_entries;
+    return true;
+}
+
+void FileReaderPrivate::closeRing()
+{
+    if (sqes)
+        munmap(sqes, sqesSize);
+    if (cqRing != MAP_FAILED && cqRing != sqRing)
+        munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED)
+        munmap(sqRing, sqRingSize);
+    if (wakeFd >= 0)
+        ::close(wakeFd);
+    if (ringFd >= 0)
+        ::close(ringFd);
+    sqes = nullptr;
+    sqRing = cqRing = MAP_FAILED;
+    wakeFd = ringFd = -1;
+}
+
+// The ring has room for every operation that can be in flight, so this never fails
+io_uring_sqe *FileReaderPrivate::nextSqe()
+{
+    unsigned tail = *sqTail;
+    Q_ASSERT(tail - loadAcquire(sqHead) < ringEntries);
+    unsigned index = tail & *sqMask;
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    storeRelease(sqTail, tail + 1);
+    unsubmitted++;
+    return sqe;
+}
+
+// Reading wakeFd completes when FileReader::read writes to it. Its user data is zero.
+void FileReaderPrivate::armWake()
+{
+    io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wakeFd;
+    sqe->addr = quint64(quintptr(&wakeValue));
+    sqe->len = sizeof(wakeValue);
+}
+
+void FileReaderPrivate::wake()
+{
+    quint64 value = 1;
+    if (::write(wakeFd, &value, sizeof(value)) < 0)
+        qCDebug(lcFileReader) << "cannot wake io_uring thread:" << qt_error_string(errno);
+}
+
+// User data of operations is the UringRead with the operation in the low bits
+static quint64 userData(FileReaderPrivate::UringRead *read, FileReaderPrivate::UringOp op)
+{
+    return quint64(quintptr(read)) | op;
+}
+
+void FileReaderPrivate::startUringRead(const std::shared_ptr<FileReadData> &fileRead)
+{
+    auto read = new UringRead;
+    read->read = fileRead;
+    read->path = QFile::encodeName(fileRead->path);
+    read->pendingOps = 2;
+    inFlight++;
+    uringReads.insert(read);
+
+    io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = quint64(quintptr(read->path.constData()));
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->user_data = userData(read, OpOpen);
+
+    sqe = nextSqe();
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = quint64(quintptr(read->path.constData()));
+    sqe->len = STATX_SIZE;
+    sqe->addr2 = quint64(quintptr(&read->stat));
+    sqe->user_data = userData(read, OpStat);
+}
+
+void FileReaderPrivate::submitUringRead(UringRead *read)
+{
+    io_uring_sqe *sqe = nextSqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = read->fd;
+    sqe->addr = quint64(quintptr(read->data.data() + read->offset));
+    sqe->len = unsigned(read->data.size() - read->offset);
+    sqe->off = quint64(read->offset);
+    sqe->user_data = userData(read, OpRead);
+}
+
+void FileReaderPrivate::finishUringRead(UringRead *read)
+{
+    if (read->fd >= 0)
+        ::close(read->fd);
+
+    uringReads.remove(read);
+    QMutexLocker l(&mutex);
+    inFlight--;
+    if (read->error.isEmpty())
+        finish(read->read.get(), read->data, QString(), read->mapping);
+    else
+        finish(read->read.get(), QByteArray(), read->error);
+    l.unlock();
+    delete read;
+}
+
+void FileReaderPrivate::completed(const io_uring_cqe *cqe)
+{
+    if (!cqe->user_data) {
+        armWake();
+        return;
+    }
+
+    auto read = reinterpret_cast<UringRead*>(quintptr(cqe->user_data & ~quint64(3)));
+    auto op = UringOp(cqe->user_data & 3);
+    if (op == OpOpen || op == OpStat) {
+        if (cqe->res < 0 && read->error.isEmpty())
+            read->error = qt_error_string(-cqe->res);
+        else if (op == OpOpen && cqe->res >= 0)
+            read->fd = cqe->res;
+        if (--read->pendingOps > 0)
+            return;
+
+        if (read->error.isEmpty()) {
+            if (read->stat.stx_size == 0)
+                read->error = QStringLiteral("File is empty");
+            else if (read->stat.stx_size > quint64(maximumFileSize))
+                read->error = QStringLiteral("File is too large");
+        }
+        if (!read->error.isEmpty()) {
+            finishUringRead(read);
+            return;
+        }
+
+        quint64 device = makedev(read->stat.stx_dev_major, read->stat.stx_dev_minor);
+        if (mapFiles && isLocal(read->fd, device)) {
+            read->mapping = mapFile(read->fd, qint64(read->stat.stx_size));
+            if (read->mapping) {
+                finishUringRead(read);
+                return;
+            }
+        }
+        read->data = QByteArray(int(read->stat.stx_size), Qt::Uninitialized);
+        submitUringRead(read);
+        return;
+    }
+
+    if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+        submitUringRead(read);
+    } else if (cqe->res < 0) {
+        read->error = qt_error_string(-cqe->res);
+        finishUringRead(read);
+    } else if (cqe->res == 0) {
+        // The file was truncated while reading
+        read->data.truncate(int(read->offset));
+        if (read->data.isEmpty())
+            read->error = QStringLiteral("File is empty");
+        finishUringRead(read);
+    } else {
+        read->offset += cqe->res;
+        if (read->offset < read->data.size())
+            submitUringRead(read);
+        else
+            finishUringRead(read);
+    }
+}
+
+void FileReaderPrivate::uringThread()
+{
+    armWake();
+    for (;;) {
+        QMutexLocker l(&mutex);
+        while (inFlight < depth && !requests.empty()) {
+            auto read = requests.front().lock();
+            requests.pop_front();
+            if (read)
+                startUringRead(read);
+        }
+        l.unlock();
+
+        int submitted = ioUringEnter(ringFd, unsubmitted, 1, IORING_ENTER_GETEVENTS);
+        if (submitted < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            qCWarning(lcFileReader) << "io_uring_enter failed, reading with threads:" << qt_error_string(errno);
+            abandonRing();
+            return;
+        }
+        unsubmitted -= unsigned(submitted);
+
+        unsigned head = *cqHead;
+        unsigned tail = loadAcquire(cqTail);
+        while (head != tail) {
+            io_uring_cqe cqe = cqes[head & *cqMask];
+            storeRelease(cqHead, ++head);
+            completed(&cqe);
+        }
+    }
+}
+
+// Fails the files in flight and hands waiting reads to the thread pool when the ring stops
+// working. The kernel may still write to the buffers of reads in flight, so they are leaked.
+void FileReaderPrivate::abandonRing()
+{
+    const QString error = QStringLiteral("io_uring failed");
+    QMutexLocker l(&mutex);
+    for (UringRead *read : uringReads) {
+        if (read->fd >= 0)
+            ::close(read->fd);
+        finish(read->read.get(), QByteArray(), error);
+        read->read.reset();
+    }
+    uringReads.clear();
+    inFlight = 0;
+    closeRing();
+    startThreads();
+    l.unlock();
+    requestsCv.wakeAll();
+}
+#endif
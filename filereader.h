@@ -0,0 +1,74 @@
+#pragma once
+
+#include <QByteArray>
+#include <QString>
+#include <memory>
+
+class FileReaderPrivate;
+struct FileReadData;
+
+// FileRead is a handle to a file being read by FileReader. A read that hasn't started
+// is abandoned when all of its handles are released.
+class FileRead
+{
+    friend class FileReader;
+
+public:
+    FileRead() { }
+
+    bool isNull() const { return !d; }
+    QString path() const;
+    bool isFinished() const;
+
+    // Wait for the read to finish. Returns the contents of the file, or a null array and
+    // sets error if it could not be read. If the file was mapped, the array refers to the
+    // mapping, and is only valid while a handle to the read is held.
+    QByteArray wait(QString *error = nullptr) const;
+
+private:
+    std::shared_ptr<FileReadData> d;
+
+    FileRead(const std::shared_ptr<FileReadData> &d)
+        : d(d)
+    {
+    }
+};
+
+// FileReader reads whole files into memory on its own threads, so that workers decoding
+// images don't wait for I/O, and many reads can be in flight at once on slow or network
+// storage. On Linux, files are opened, sized and read through io_uring by one thread.
+// Elsewhere, or when io_uring is not available, a pool of threads reads with blocking
+// calls.
+//
+// Setting SPEEDYIMAGE_MMAP=1 maps files on local filesystems rather than copying them, and
+// asks the kernel to read them ahead, so decoders read straight from the page cache. Network
+// filesystems are still read, so that decoders never wait for page faults over the network.
+// Mapping is off by default, although it was first added as on by default with
+// SPEEDYIMAGE_MMAP=0 to disable it: a file truncated while it's mapped raises SIGBUS when
+// the truncated part is read, which crashes the application, and checking the size after
+// mapping can't catch a truncation during decoding. Only enable it for libraries whose files
+// are never modified in place.
+//
+// Reads are shared: reading a path again while an earlier read of it is still held returns
+// that read, without checking if the file has changed since.
+//
+// Up to SPEEDYIMAGE_IO_DEPTH (default 16) files are read at once. Setting
+// SPEEDYIMAGE_IO_URING=0 always uses the thread pool.
+//
+// All functions are thread-safe.
+class FileReader
+{
+public:
+    static FileReader *instance();
+
+    ~FileReader();
+
+    // Start reading path. Urgent reads start before any others that are waiting, for
+    // callers that will wait for the result right away.
+    FileRead read(const QString &path, bool urgent = false);
+
+private:
+    std::unique_ptr<FileReaderPrivate> d;
+
+    FileReader();
+};
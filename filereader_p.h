@@ -0,0 +1,133 @@
+#pragma once
+
+#include "filereader.h"
+#include <QHash>
+#include <QSet>
+#include <QMutex>
+#include <QWaitCondition>
+#include <deque>
+
+#ifdef SPEEDYIMAGE_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/stat.h>
+#endif
+
+// A read-only mapping of a file, unmapped when the last read using it is released
+struct FileMapping
+{
+    uchar *data = nullptr;
+    size_t length = 0;
+
+    ~FileMapping();
+};
+
+// All members are protected by the reader's mutex
+struct FileReadData
+{
+    FileReaderPrivate *reader;
+    QString path;
+    bool finished = false;
+    QByteArray data;
+    QString error;
+    // Set if data refers to a mapping of the file
+    std::shared_ptr<FileMapping> mapping;
+};
+
+class FileReaderPrivate
+{
+public:
+    FileReaderPrivate();
+    ~FileReaderPrivate();
+
+    QMutex mutex;
+    // Signalled when any read finishes
+    QWaitCondition readFinished;
+    // Reads that have not started, in the order they will start
+    std::deque<std::weak_ptr<FileReadData>> requests;
+    int depth;
+
+    // Reads of each path that may still be held, so that loads of the same file share them.
+    // Expired entries are removed when the hash has doubled since the last sweep.
+    QHash<QString,std::weak_ptr<FileReadData>> reads;
+    int sweptReads;
+
+    // Files on local filesystems are mapped if SPEEDYIMAGE_MMAP is 1
+    bool mapFiles;
+    QHash<quint64,bool> localDevices;
+
+    bool isLocal(int fd, quint64 device);
+    static std::shared_ptr<FileMapping> mapFile(int fd, qint64 size);
+
+    void finish(FileReadData *read, const QByteArray &data, const QString &error,
+                const std::shared_ptr<FileMapping> &mapping = std::shared_ptr<FileMapping>());
+
+    // Thread pool, used without io_uring. Threads are started on demand and never exit.
+    QWaitCondition requestsCv;
+    int threadCount;
+    int idleThreads;
+
+    void startThreads();
+    void poolThread();
+    QByteArray readFile(const QString &path, QString &error, std::shared_ptr<FileMapping> &mapping);
+
+#ifdef SPEEDYIMAGE_HAVE_IO_URING
+    enum UringOp : quint64 {
+        OpOpen,
+        OpStat,
+        OpRead
+    };
+
+    // A file being read through io_uring, only accessed by the io_uring thread. Open and
+    // statx run at the same time, and the read starts when both have finished.
+    struct UringRead
+    {
+        std::shared_ptr<FileReadData> read;
+        QByteArray path;
+        int fd = -1;
+        int pendingOps = 0;
+        struct statx stat;
+        QByteArray data;
+        qint64 offset = 0;
+        QString error;
+        std::shared_ptr<FileMapping> mapping;
+    };
+
+    int ringFd;
+    unsigned ringEntries;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    io_uring_cqe *cqes;
+    // Entries added to the submission queue since the last io_uring_enter
+    unsigned unsubmitted;
+
+    // eventfd written by FileReader::read to wake the io_uring thread
+    int wakeFd;
+    quint64 wakeValue;
+    // Files being read by the io_uring thread
+    int inFlight;
+    QSet<UringRead*> uringReads;
+
+    bool setupRing();
+    void closeRing();
+    io_uring_sqe *nextSqe();
+    void armWake();
+    void wake();
+    void startUringRead(const std::shared_ptr<FileReadData> &read);
+    void submitUringRead(UringRead *read);
+    void finishUringRead(UringRead *read);
+    void completed(const io_uring_cqe *cqe);
+    void uringThread();
+    void abandonRing();
+#endif
+};
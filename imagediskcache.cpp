@@ -0,0 +1,304 @@
+#include "imagediskcache_p.h"
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFileInfo>
+#include <QLoggingCategory>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <algorithm>
+
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+Q_LOGGING_CATEGORY(lcDiskCache, "speedyimage.diskcache")
+
+ImageDiskCache *ImageDiskCache::instance()
+{
+    static ImageDiskCache *cache = []() -> ImageDiskCache* {
+        qint64 maxSize = qgetenv("SPEEDYIMAGE_DISK_CACHE_SIZE").toLongLong();
+        if (maxSize < 1)
+            return nullptr;
+
+        QString path = QString::fromLocal8Bit(qgetenv("SPEEDYIMAGE_DISK_CACHE_PATH"));
+        if (path.isEmpty())
+            path = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + QStringLiteral("/speedyimage");
+        if (!QDir().mkpath(path)) {
+            qCWarning(lcDiskCache) << "cannot create disk cache directory" << path;
+            return nullptr;
+        }
+
+        qCDebug(lcDiskCache) << "using disk cache" << path << "with size" << maxSize;
+        return new ImageDiskCache(path, maxSize);
+    }();
+    return cache;
+}
+
+ImageDiskCache::ImageDiskCache(const QString &path, qint64 maxSize)
+    : d(new ImageDiskCachePrivate(path, maxSize))
+{
+}
+
+ImageDiskCache::~ImageDiskCache()
+{
+}
+
+ImageDiskCachePrivate::ImageDiskCachePrivate(const QString &path, qint64 maxSize)
+    : path(path)
+    , maxSize(maxSize)
+    , scanned(false)
+    , totalSize(0)
+{
+}
+
+qint64 ImageDiskCache::maxSize() const
+{
+    return d->maxSize;
+}
+
+qint64 ImageDiskCache::size() const
+{
+    QMutexLocker l(&d->mutex);
+    d->scan();
+    return d->totalSize;
+}
+
+QString ImageDiskCache::cacheKey(const QString &path, const QSize &drawSize)
+{
+    QFileInfo info(path);
+    if (!info.isFile())
+        return QString();
+
+    // Draw sizes are bucketed by the next power of two of the larger dimension, so that
+    // slightly different sizes of the same thumbnail can share an entry.
+    int side = qMax(drawSize.width(), drawSize.height());
+    int bucket = 1;
+    while (bucket < side)
+        bucket <<= 1;
+
+    return QStringLiteral("%1\n%2\n%3\n%4").arg(info.absoluteFilePath())
+        .arg(info.lastModified().toMSecsSinceEpoch())
+        .arg(info.size())
+        .arg(bucket);
+}
+
+QString ImageDiskCachePrivate::fileName(const QString &key)
+{
+    return QString::fromLatin1(QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex()) + QStringLiteral(".sic");
+}
+
+// Memory holding the contents of a cache file, released when the QImage using it is freed.
+// Mappings are read-only, so images use it as const data and detach before any write.
+struct ImageDiskCacheMapping
+{
+    const uchar *data;
+    size_t length;
+};
+
+static void releaseMapping(void *info)
+{
+    auto mapping = static_cast<ImageDiskCacheMapping*>(info);
+#ifdef Q_OS_UNIX
+    ::munmap(const_cast<uchar*>(mapping->data), mapping->length);
+#else
+    ::free(const_cast<uchar*>(mapping->data));
+#endif
+    delete mapping;
+}
+
+static ImageDiskCacheMapping *mapFile(const QString &fileName)
+{
+#ifdef Q_OS_UNIX
+    int fd = ::open(QFile::encodeName(fileName).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0)
+        data = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return nullptr;
+
+    return new ImageDiskCacheMapping{static_cast<const uchar*>(data), size_t(st.st_size)};
+#else
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly) || file.size() < 1)
+        return nullptr;
+
+    auto data = static_cast<uchar*>(::malloc(size_t(file.size())));
+    if (!data)
+        return nullptr;
+    if (file.read(reinterpret_cast<char*>(data), file.size()) != file.size()) {
+        ::free(data);
+        return nullptr;
+    }
+
+    return new ImageDiskCacheMapping{data, size_t(file.size())};
+#endif
+}
+
+bool ImageDiskCache::lookup(const QString &path, const QSize &drawSize, QImage &image, QSize &imageSize)
+{
+    QString key = cacheKey(path, drawSize);
+    if (key.isEmpty())
+        return false;
+    QString name = ImageDiskCachePrivate::fileName(key);
+    QString fileName = d->path + QLatin1Char('/') + name;
+
+    auto mapping = mapFile(fileName);
+    if (!mapping)
+        return false;
+
+    using FileHeader = ImageDiskCachePrivate::FileHeader;
+    QByteArray keyData = key.toUtf8();
+    const FileHeader *header = reinterpret_cast<const FileHeader*>(mapping->data);
+    if (mapping->length < sizeof(FileHeader) ||
+        header->magic != ImageDiskCachePrivate::fileMagic ||
+        header->version != ImageDiskCachePrivate::fileVersion ||
+        header->width < 1 || header->height < 1 ||
+        header->format <= QImage::Format_Invalid || header->format >= QImage::NImageFormats ||
+        header->keyLength != quint32(keyData.size()) ||
+        sizeof(FileHeader) + header->keyLength > header->dataOffset ||
+        header->dataOffset + quint64(header->bytesPerLine) * quint64(header->height) > mapping->length ||
+        memcmp(mapping->data + sizeof(FileHeader), keyData.constData(), size_t(keyData.size())) != 0)
+    {
+        qCDebug(lcDiskCache) << "invalid entry for" << path << "in" << name;
+        releaseMapping(mapping);
+        return false;
+    }
+
+    // The entry must be large enough for the requested draw size, unless it's the full image
+    QSize size(header->width, header->height);
+    QSize fullSize(header->imageWidth, header->imageHeight);
+    if (!drawSize.isEmpty() && size != fullSize) {
+        QSize needed = fullSize.scaled(drawSize, Qt::KeepAspectRatio);
+        if (size.width() < needed.width() - 1 || size.height() < needed.height() - 1) {
+            qCDebug(lcDiskCache) << "entry for" << path << "at" << size << "is too small for" << drawSize;
+            releaseMapping(mapping);
+            return false;
+        }
+    }
+
+    image = QImage(mapping->data + header->dataOffset, header->width, header->height, header->bytesPerLine,
+                   QImage::Format(header->format), releaseMapping, mapping);
+    imageSize = fullSize;
+    qCDebug(lcDiskCache) << "loaded" << path << "at" << size << "from" << name;
+
+#ifdef Q_OS_UNIX
+    // File modification times record use for eviction by later processes
+    ::utimensat(AT_FDCWD, QFile::encodeName(fileName).constData(), nullptr, 0);
+#endif
+
+    QMutexLocker l(&d->mutex);
+    d->scan();
+    d->touch(name, qint64(mapping->length));
+    return true;
+}
+
+void ImageDiskCache::insert(const QString &path, const QSize &drawSize, const QImage &image, const QSize &imageSize)
+{
+    QString key = cacheKey(path, drawSize);
+    if (key.isEmpty() || image.isNull())
+        return;
+    QString name = ImageDiskCachePrivate::fileName(key);
+    QByteArray keyData = key.toUtf8();
+
+    ImageDiskCachePrivate::FileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = ImageDiskCachePrivate::fileMagic;
+    header.version = ImageDiskCachePrivate::fileVersion;
+    header.width = image.width();
+    header.height = image.height();
+    header.bytesPerLine = image.bytesPerLine();
+    header.format = image.format();
+    header.imageWidth = imageSize.width();
+    header.imageHeight = imageSize.height();
+    header.keyLength = quint32(keyData.size());
+    // Pixel data is aligned for the benefit of anything reading it from the mapping
+    header.dataOffset = quint32((sizeof(header) + keyData.size() + 63) & ~size_t(63));
+
+    // QSaveFile writes to a temporary file and renames it on commit, so a crash can never
+    // leave a partially written entry.
+    QSaveFile file(d->path + QLatin1Char('/') + name);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCDebug(lcDiskCache) << "cannot write" << file.fileName() << file.errorString();
+        return;
+    }
+
+    qint64 dataSize = qint64(image.bytesPerLine()) * image.height();
+    QByteArray padding(int(header.dataOffset - sizeof(header) - keyData.size()), 0);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(keyData);
+    file.write(padding);
+    file.write(reinterpret_cast<const char*>(image.constBits()), dataSize);
+    if (!file.commit()) {
+        qCDebug(lcDiskCache) << "cannot write" << file.fileName() << file.errorString();
+        return;
+    }
+
+    qCDebug(lcDiskCache) << "stored" << path << "at" << image.size() << "in" << name;
+
+    QMutexLocker l(&d->mutex);
+    d->scan();
+    d->touch(name, header.dataOffset + dataSize);
+    d->evict();
+}
+
+// Load the size and last use of existing entries, once
+void ImageDiskCachePrivate::scan()
+{
+    if (scanned)
+        return;
+    scanned = true;
+
+    const auto files = QDir(path).entryInfoList({QStringLiteral("*.sic")}, QDir::Files);
+    for (const QFileInfo &info : files) {
+        entries.insert(info.fileName(), Entry{info.size(), info.lastModified().toMSecsSinceEpoch()});
+        totalSize += info.size();
+    }
+    qCDebug(lcDiskCache) << "found" << entries.size() << "entries using" << totalSize << "of" << maxSize;
+}
+
+void ImageDiskCachePrivate::touch(const QString &name, qint64 size)
+{
+    auto it = entries.find(name);
+    if (it != entries.end()) {
+        totalSize -= it->size;
+        it->size = size;
+        it->lastUsed = QDateTime::currentMSecsSinceEpoch();
+    } else {
+        entries.insert(name, Entry{size, QDateTime::currentMSecsSinceEpoch()});
+    }
+    totalSize += size;
+}
+
+// Remove the least recently used entries until the cache is under 90% of its maximum size
+void ImageDiskCachePrivate::evict()
+{
+    if (totalSize <= maxSize)
+        return;
+
+    QVector<QPair<qint64,QString>> order;
+    order.reserve(entries.size());
+    for (auto it = entries.constBegin(); it != entries.constEnd(); it++)
+        order.append(qMakePair(it->lastUsed, it.key()));
+    std::sort(order.begin(), order.end());
+
+    qint64 target = maxSize - maxSize / 10;
+    int removed = 0;
+    for (const auto &item : order) {
+        if (totalSize <= target)
+            break;
+        // Mapped entries remain valid after the file is removed
+        QFile::remove(path + QLatin1Char('/') + item.second);
+        totalSize -= entries.take(item.second).size;
+        removed++;
+    }
+
+    qCDebug(lcDiskCache) << "evicted" << removed << "entries, using" << totalSize << "of" << maxSize;
+}
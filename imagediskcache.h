@@ -0,0 +1,44 @@
+#pragma once
+
+#include <QImage>
+#include <QString>
+#include <memory>
+
+class ImageDiskCachePrivate;
+
+// ImageDiskCache is a persistent cache of downscaled images, used by ImageLoader to
+// avoid decoding the same thumbnails in every process. Entries are keyed by the path,
+// modification time and size of the source file and by a bucket of the draw size, and
+// are stored as raw pixels that can be mapped directly into a QImage.
+//
+// The cache is enabled by setting SPEEDYIMAGE_DISK_CACHE_SIZE to the maximum size in
+// bytes. Entries are stored in SPEEDYIMAGE_DISK_CACHE_PATH, or in a speedyimage directory
+// under the application's cache location. The least recently used entries are removed
+// when the cache is full.
+//
+// All functions are thread-safe.
+class ImageDiskCache
+{
+public:
+    // Returns the process-wide disk cache, or nullptr if it is disabled
+    static ImageDiskCache *instance();
+
+    ~ImageDiskCache();
+
+    // Find an image for path large enough to draw at drawSize. The returned image may
+    // be backed by a read-only mapping of the cache file.
+    bool lookup(const QString &path, const QSize &drawSize, QImage &image, QSize &imageSize);
+    void insert(const QString &path, const QSize &drawSize, const QImage &image, const QSize &imageSize);
+
+    qint64 maxSize() const;
+    qint64 size() const;
+
+    // Key for a cached image of path at drawSize, or an empty string if path is not a
+    // file. Also used to identify entries in ImageSharedCache.
+    static QString cacheKey(const QString &path, const QSize &drawSize);
+
+private:
+    std::unique_ptr<ImageDiskCachePrivate> d;
+
+    ImageDiskCache(const QString &path, qint64 maxSize);
+};
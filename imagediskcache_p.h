@@ -0,0 +1,51 @@
+#pragma once
+
+#include "imagediskcache.h"
+#include <QHash>
+#include <QMutex>
+#include <QDateTime>
+
+class ImageDiskCachePrivate
+{
+public:
+    struct Entry
+    {
+        qint64 size;
+        qint64 lastUsed;
+    };
+
+    // Header of a cache file, followed by the key and pixel data at dataOffset
+    struct FileHeader
+    {
+        quint32 magic;
+        quint32 version;
+        qint32 width;
+        qint32 height;
+        qint32 bytesPerLine;
+        qint32 format;
+        qint32 imageWidth;
+        qint32 imageHeight;
+        quint32 keyLength;
+        quint32 dataOffset;
+    };
+
+    static const quint32 fileMagic = 0x53494443; // SIDC
+    static const quint32 fileVersion = 1;
+
+    ImageDiskCachePrivate(const QString &path, qint64 maxSize);
+
+    const QString path;
+    const qint64 maxSize;
+
+    // Protects everything below
+    QMutex mutex;
+    bool scanned;
+    QHash<QString,Entry> entries;
+    qint64 totalSize;
+
+    static QString fileName(const QString &key);
+
+    void scan();
+    void touch(const QString &name, qint64 size);
+    void evict();
+};
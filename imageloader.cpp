@@ -1,202 +1,1298 @@
 #include "imageloader_p.h"
+#include "imagediskcache.h"
+#include "imagemetadataindex.h"
+#ifdef SPEEDYIMAGE_HAVE_SHARED_CACHE
+#include "imagesharedcache.h"
+#endif
+#include "embeddedthumbnail.h"
+#include "imagescaler.h"
+#include "uploadformat.h"
+#ifdef SPEEDYIMAGE_HAVE_LIBJPEG
+#include "jpegdecoder.h"
+#endif
+#ifdef SPEEDYIMAGE_HAVE_LIBPNG
+#include "pngdecoder.h"
+#endif
+#include "cgroup.h"
+#include "filereader.h"
+#include <QBuffer>
 #include <QImageReader>
+#include <QQmlEngine>
+#include <QTransform>
+#include <climits>
+#include <thread>
+
+#ifdef Q_OS_LINUX
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 Q_LOGGING_CATEGORY(lcImageLoad, "speedyimage.load")
 
+// Decode memory reservations and suspended tasks of the current worker
+static thread_local int threadReservations = 0;
+static thread_local qint64 threadReservedBytes = 0;
+static thread_local int suspendedTasks = 0;
+// Workers of all groups with a suspended task. Only one is allowed at once, so that a task
+// run while another is suspended only waits for decode memory held by workers that can
+// finish.
+static QAtomicInt suspendedWorkers;
+
+static bool coversDrawSize(const QSize &size, const QSize &imageSize, const QSize &drawSize);
+static qint64 imageBytes(const QSize &size);
+
+// Apply an orientation in the same order as QImageReader's autoTransform
+static QImage applyTransformation(const QImage &image, QImageIOHandler::Transformations transform)
+{
+    if (transform == QImageIOHandler::TransformationNone)
+        return image;
+    QImage result = image.mirrored(transform.testFlag(QImageIOHandler::TransformationMirror),
+                                  transform.testFlag(QImageIOHandler::TransformationFlip));
+    if (transform & QImageIOHandler::TransformationRotate90)
+        result = result.transformed(QTransform().rotate(90));
+    return result;
+}
+
+QHash<QString,ImageLoader*> ImageLoaderPrivate::groups;
+QMutex ImageLoaderPrivate::decodeMemoryMutex;
+QWaitCondition ImageLoaderPrivate::decodeMemoryCv;
+qint64 ImageLoaderPrivate::decodeMemory = 0;
+
 ImageLoader::ImageLoader(QObject *parent)
+    : ImageLoader(QString(), parent)
+{
+}
+
+ImageLoader::ImageLoader(const QString &group, QObject *parent)
     : QObject(parent)
-    , d(new ImageLoaderPrivate(this))
+    , d(new ImageLoaderPrivate(this, group))
+{
+}
+
+ImageLoader *ImageLoader::instance()
+{
+    return forGroup(QString());
+}
+
+ImageLoader *ImageLoader::forGroup(const QString &group)
+{
+    ImageLoader *loader = ImageLoaderPrivate::groups.value(group);
+    if (!loader) {
+        loader = new ImageLoader(group, nullptr);
+        // Loaders are returned to QML by group(), but live for the whole process
+        QQmlEngine::setObjectOwnership(loader, QQmlEngine::CppOwnership);
+        ImageLoaderPrivate::groups.insert(group, loader);
+        if (!group.isEmpty())
+            ImageLoaderPrivate::updateDefaultThreads();
+        qCDebug(lcImageLoad) << "created loader group" << group << "with" << loader->maxThreads() << "threads";
+    }
+    return loader;
+}
+
+QString ImageLoader::groupName() const
 {
+    return d->group;
 }
 
-ImageLoaderPrivate::ImageLoaderPrivate(ImageLoader *q)
+ImageLoaderPrivate::ImageLoaderPrivate(ImageLoader *q, const QString &group)
     : q(q)
+    , group(group)
     , stopping(false)
+    , maxThreads(defaultThreadCount(group))
+    , maxThreadsSet(false)
+    , threadCount(0)
+    , idleThreads(0)
+    , idleTimeout(30000)
+    , nextSeq(0)
+    , agingInterval(qgetenv("SPEEDYIMAGE_LOADER_AGING").toInt())
+    , previews(qgetenv("SPEEDYIMAGE_PREVIEWS") != "0")
+    , preemptPriority(32)
+    , readAhead(qgetenv("SPEEDYIMAGE_READ_AHEAD").toInt())
+    , readsAhead(0)
+    , persistentCache(ImageDiskCache::instance())
 {
+    if (agingInterval < 1) {
+        agingInterval = 50;
+    }
+    if (readAhead < 0) {
+        readAhead = 0;
+    } else if (!qEnvironmentVariableIsSet("SPEEDYIMAGE_READ_AHEAD")) {
+        readAhead = 8;
+    }
+#ifdef SPEEDYIMAGE_HAVE_SHARED_CACHE
+    persistentCache = persistentCache || ImageSharedCache::instance();
+#endif
+    if (qEnvironmentVariableIsSet("SPEEDYIMAGE_LOADER_PREEMPT")) {
+        preemptPriority = qgetenv("SPEEDYIMAGE_LOADER_PREEMPT").toInt();
+    }
+    if (qEnvironmentVariableIsSet("SPEEDYIMAGE_LOADER_IDLE")) {
+        idleTimeout = qgetenv("SPEEDYIMAGE_LOADER_IDLE").toInt();
+    }
+    clock.start();
 }
 
 ImageLoader::~ImageLoader()
 {
 }
 
+// Workers are detached, so wait for them to exit before they lose the loader
 ImageLoaderPrivate::~ImageLoaderPrivate()
 {
+    QMutexLocker l(&mutex);
+    stopping = true;
+    cv.wakeAll();
+    while (threadCount > 0)
+        threadsExited.wait(&mutex);
+}
+
+int ImageLoader::maxThreads() const
+{
+    QMutexLocker l(&d->mutex);
+    return d->maxThreads;
+}
+
+void ImageLoader::setMaxThreads(int maxThreads)
+{
+    d->maxThreadsSet = true;
+    d->applyMaxThreads(maxThreads);
+    if (!d->group.isEmpty())
+        ImageLoaderPrivate::updateDefaultThreads();
+}
+
+// Extra workers exit once they finish their current load
+void ImageLoaderPrivate::applyMaxThreads(int threads)
+{
+    threads = qMax(threads, 1);
+    QMutexLocker l(&mutex);
+    if (maxThreads == threads)
+        return;
+    maxThreads = threads;
+    startWorkers();
+    l.unlock();
+
+    cv.wakeAll();
+    emit q->maxThreadsChanged();
+}
+
+int ImageLoader::idleTimeout() const
+{
+    QMutexLocker l(&d->mutex);
+    return d->idleTimeout;
+}
+
+void ImageLoader::setIdleTimeout(int timeout)
+{
+    QMutexLocker l(&d->mutex);
+    if (d->idleTimeout == timeout)
+        return;
+    d->idleTimeout = timeout;
+    l.unlock();
+
+    d->cv.wakeAll();
+    emit idleTimeoutChanged();
 }
 
 ImageLoaderJob ImageLoader::enqueue(const QString &path, const QSize &drawSize, int priority, ImageLoaderCallback callback)
 {
     ImageLoaderJob newJob(path, drawSize, priority, callback);
+    newJob.d->loader = d;
 
-    // This algorithm is ..very far from ideal
     QMutexLocker l(&d->mutex);
-    for (auto &jobList : d->queue) {
-        for (auto &job : jobList) {
-            auto jobData = job.lock();
-            if (!jobData) {
-                continue;
-            } else if (jobData->path != path) {
-                break;
-            } else {
-                qCDebug(lcImageLoad) << "enqueued with existing job for" << path << "with draw size" << drawSize;
-                jobList.append(newJob.d);
-                goto queued;
-            }
+    d->enqueueJob(newJob.d);
+    d->queueReads();
+    d->startWorkers();
+    l.unlock();
+    d->cv.wakeOne();
+    d->startReads();
+
+    return newJob;
+}
+
+QVector<ImageLoaderJob> ImageLoader::enqueue(const QStringList &paths, const QSize &drawSize, int priority,
+                                             ImageLoaderCallback callback)
+{
+    QVector<ImageLoaderJob> jobs;
+    jobs.reserve(paths.size());
+    for (const QString &path : paths) {
+        ImageLoaderJob newJob(path, drawSize, priority, callback);
+        newJob.d->loader = d;
+        jobs.append(newJob);
+    }
+
+    QMutexLocker l(&d->mutex);
+    for (const ImageLoaderJob &job : jobs)
+        d->enqueueJob(job.d);
+    d->queueReads();
+    d->startWorkers();
+    l.unlock();
+    d->cv.wakeAll();
+    d->startReads();
+
+    return jobs;
+}
+
+// Called with mutex held
+void ImageLoaderPrivate::enqueueJob(const std::shared_ptr<ImageLoaderJobData> &job)
+{
+    const QString &path = job->path;
+    const QSize &drawSize = job->drawSize;
+
+    // Join a pending task for the same path, or a running task which is loading at a
+    // large enough size. If the running task is too small, a new task is queued for the
+    // larger size, and both will be delivered.
+    TaskPtr task = pending.value(path);
+    if (!task) {
+        auto active = running.value(path);
+        if (active && active->covers(drawSize))
+            task = active;
+    }
+
+    if (task) {
+        qCDebug(lcImageLoad) << "enqueued with existing" << (task->running ? "running" : "pending") << "job for" << path << "with draw size" << drawSize;
+        task->jobs.append(job);
+        if (job->priority > task->priority && !task->running) {
+            task->priority = job->priority;
+            updateRank(task.get());
+            queueUpdate(task.get());
         }
+    } else {
+        task = std::make_shared<ImageLoaderTask>();
+        task->path = path;
+        task->jobs.append(job);
+        task->priority = job->priority;
+        task->enqueuedAt = clock.elapsed();
+        task->seq = nextSeq++;
+        updateRank(task.get());
+        queuePush(task);
+        pending.insert(path, task);
+        qCDebug(lcImageLoad) << "enqueued new job for" << path << "with draw size" << drawSize << "priority" << job->priority;
     }
+    job->task = task;
+}
+
+bool ImageLoader::previewsEnabled() const
+{
+    return d->previews.loadAcquire();
+}
+
+void ImageLoader::setPreviewsEnabled(bool enabled)
+{
+    d->previews.storeRelease(enabled);
+}
+
+void ImageLoaderJob::setPriority(int priority)
+{
+    if (!d)
+        return;
+    auto loader = d->loader.lock();
+    if (loader)
+        loader->setJobPriority(d.get(), priority);
+    else
+        d->priority = priority;
+}
+
+bool ImageLoaderJob::finished() const
+{
+    if (!d)
+        return false;
+    QMutexLocker l(&d->resultMutex);
+    return (d->result && !d->preview) || !d->error.isEmpty();
+}
+
+bool ImageLoaderJob::isPreview() const
+{
+    if (!d)
+        return false;
+    QMutexLocker l(&d->resultMutex);
+    return d->preview;
+}
 
-    // Priority is primitive at the moment
-    if (priority > 0) {
-        d->queue.push_front(ImageLoaderPrivate::JobDataList{newJob.d});
+QImage ImageLoaderJob::result() const
+{
+    if (!d)
+        return QImage();
+    QMutexLocker l(&d->resultMutex);
+    return d->result ? *d->result : QImage();
+}
+
+QSize ImageLoaderJob::imageSize() const
+{
+    if (!d)
+        return QSize();
+    QMutexLocker l(&d->resultMutex);
+    return d->resultSize;
+}
+
+QString ImageLoaderJob::error() const
+{
+    if (!d)
+        return QString();
+    QMutexLocker l(&d->resultMutex);
+    return d->error;
+}
+
+void ImageLoaderJob::cancel()
+{
+    if (!d)
+        return;
+    auto loader = d->loader.lock();
+    if (loader)
+        loader->cancelJob(d.get());
+}
+
+// True if any job loads the image at full size, which is never cached
+bool ImageLoaderTask::isFullSize() const
+{
+    for (const auto &weakJob : jobs) {
+        auto job = weakJob.lock();
+        if (job && job->drawSize.width() < 1 && job->drawSize.height() < 1)
+            return true;
+    }
+    return false;
+}
+
+// The loader only holds weak references to jobs, so a job that is released rather than
+// cancelled leaves its task here
+ImageLoaderJobData::~ImageLoaderJobData()
+{
+    // No other thread can access the task pointer of a job that is being destroyed
+    if (auto t = task.lock())
+        t->jobsChanged.storeRelease(1);
+}
+
+bool ImageLoaderTask::hasLiveJobs() const
+{
+    for (const auto &job : jobs) {
+        if (!job.expired())
+            return true;
+    }
+    return false;
+}
+
+// True if the result of this running task will be at least as large as a request for drawSize
+bool ImageLoaderTask::covers(const QSize &size) const
+{
+    if (!running || !drawSize.isValid())
+        return false;
+    if (drawSize.isEmpty())
+        return true; // full size
+
+    QSize request = size;
+    if (request.isEmpty()) {
+        if ((request.width() == 0 && request.height() == 0) || imageSize.isEmpty())
+            return false;
+        if (request.width() > 0)
+            request.setHeight(qRound(imageSize.height() * (double(request.width()) / imageSize.width())));
+        else
+            request.setWidth(qRound(imageSize.width() * (double(request.height()) / imageSize.height())));
+    }
+
+    return request.width() <= drawSize.width() && request.height() <= drawSize.height();
+}
+
+// Tasks are ordered by priority adjusted by the time they have waited. Because every
+// task ages at the same rate, the relative order of two tasks never changes while they
+// wait, and the rank can be calculated once instead of continuously.
+void ImageLoaderPrivate::updateRank(ImageLoaderTask *task)
+{
+    task->rank = qint64(task->priority) * agingInterval - task->enqueuedAt;
+}
+
+// Recalculate the priority of a task from its remaining jobs and update its position
+void ImageLoaderPrivate::updatePriority(ImageLoaderTask *task)
+{
+    bool any = false;
+    int priority = 0;
+    for (const auto &weakJob : task->jobs) {
+        auto job = weakJob.lock();
+        if (!job)
+            continue;
+        priority = any ? qMax(priority, job->priority) : job->priority;
+        any = true;
+    }
+
+    if (any && priority != task->priority) {
+        task->priority = priority;
+        updateRank(task);
+        if (task->heapIndex >= 0)
+            queueUpdate(task);
+    }
+}
+
+static bool runsBefore(const ImageLoaderTask *a, const ImageLoaderTask *b)
+{
+    if (a->rank != b->rank)
+        return a->rank > b->rank;
+    return a->seq < b->seq;
+}
+
+void ImageLoaderPrivate::siftUp(size_t i)
+{
+    TaskPtr task = std::move(queue[i]);
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!runsBefore(task.get(), queue[parent].get()))
+            break;
+        queue[i] = std::move(queue[parent]);
+        queue[i]->heapIndex = int(i);
+        i = parent;
+    }
+    queue[i] = std::move(task);
+    queue[i]->heapIndex = int(i);
+}
+
+void ImageLoaderPrivate::siftDown(size_t i)
+{
+    TaskPtr task = std::move(queue[i]);
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= queue.size())
+            break;
+        if (child + 1 < queue.size() && runsBefore(queue[child + 1].get(), queue[child].get()))
+            child++;
+        if (!runsBefore(queue[child].get(), task.get()))
+            break;
+        queue[i] = std::move(queue[child]);
+        queue[i]->heapIndex = int(i);
+        i = child;
+    }
+    queue[i] = std::move(task);
+    queue[i]->heapIndex = int(i);
+}
+
+void ImageLoaderPrivate::queuePush(const TaskPtr &task)
+{
+    queue.push_back(task);
+    siftUp(queue.size() - 1);
+    queueChanges.ref();
+}
+
+ImageLoaderPrivate::TaskPtr ImageLoaderPrivate::queuePop()
+{
+    if (queue.empty())
+        return TaskPtr();
+    TaskPtr task = queue.front();
+    queueRemove(task.get());
+    return task;
+}
+
+void ImageLoaderPrivate::queueRemove(ImageLoaderTask *task)
+{
+    size_t i = size_t(task->heapIndex);
+    Q_ASSERT(task->heapIndex >= 0 && queue[i].get() == task);
+
+    TaskPtr last = std::move(queue.back());
+    queue.pop_back();
+    task->heapIndex = -1;
+    if (i < queue.size()) {
+        queue[i] = std::move(last);
+        queue[i]->heapIndex = int(i);
+        queueUpdate(queue[i].get());
+    }
+}
+
+void ImageLoaderPrivate::queueUpdate(ImageLoaderTask *task)
+{
+    siftUp(size_t(task->heapIndex));
+    siftDown(size_t(task->heapIndex));
+    queueChanges.ref();
+}
+
+void ImageLoaderPrivate::setJobPriority(ImageLoaderJobData *job, int priority)
+{
+    QMutexLocker l(&mutex);
+    if (job->priority == priority)
+        return;
+    job->priority = priority;
+
+    // The priority of running tasks decides if they can be preempted
+    auto task = job->task.lock();
+    if (task && (task->heapIndex >= 0 || task->running))
+        updatePriority(task.get());
+    if (task && task->running)
+        queueChanges.ref();
+}
+
+void ImageLoaderPrivate::cancelJob(ImageLoaderJobData *job)
+{
+    QMutexLocker l(&mutex);
+    auto task = job->task.lock();
+    if (!task)
+        return;
+    job->task.reset();
+    task->jobsChanged.storeRelease(1);
+
+    for (int i = 0; i < task->jobs.size(); i++) {
+        if (task->jobs[i].lock().get() == job) {
+            task->jobs.remove(i);
+            break;
+        }
+    }
+
+    if (task->heapIndex < 0)
+        return;
+    if (!task->hasLiveJobs()) {
+        qCDebug(lcImageLoad) << "cancelled job for" << task->path;
+        queueRemove(task.get());
+        if (pending.value(task->path) == task)
+            pending.remove(task->path);
+        if (task->readingAhead) {
+            task->readingAhead = false;
+            task->read = FileRead();
+            readsAhead--;
+        }
     } else {
-        d->queue.push_back(ImageLoaderPrivate::JobDataList{newJob.d});
+        updatePriority(task.get());
+    }
+}
+
+// Threads for all loader groups together: SPEEDYIMAGE_LOADER_THREADS, or one less than the
+// number of CPUs available to the process
+int ImageLoaderPrivate::availableThreads()
+{
+    int threads = qgetenv("SPEEDYIMAGE_LOADER_THREADS").toInt();
+    if (threads > 0)
+        return threads;
+
+    int cpus = int(std::thread::hardware_concurrency());
+#ifdef Q_OS_LINUX
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+        cpus = CPU_COUNT(&set);
+#endif
+
+    // cpu.max is "<quota> <period>", or "max <period>" without a quota
+    QList<QByteArray> cpuMax = readCgroupFile(currentCgroupPath(), QStringLiteral("cpu.max")).split(' ');
+    qint64 quota = cpuMax.value(0).toLongLong();
+    qint64 period = cpuMax.value(1).toLongLong();
+    if (quota > 0 && period > 0) {
+        int quotaCpus = int((quota + period - 1) / period);
+        cpus = cpus > 0 ? qMin(cpus, quotaCpus) : quotaCpus;
     }
-    qCDebug(lcImageLoad) << "enqueued new job for" << path << "with draw size" << drawSize;
 
-queued:
-    if (d->workers.empty()) {
-        d->startWorkers();
+    return qMax(cpus - 1, 1);
+}
+
+// Named groups take half of the available threads, and the default group has what the
+// named groups leave, so that together they don't oversubscribe the CPUs
+int ImageLoaderPrivate::defaultThreadCount(const QString &group)
+{
+    static const int available = availableThreads();
+
+    if (!group.isEmpty()) {
+        int threads = qgetenv("SPEEDYIMAGE_LOADER_THREADS_" + group.toUpper().toLatin1()).toInt();
+        if (threads > 0)
+            return threads;
+        return qMax(available / 2, 1);
     }
-    l.unlock();
-    d->cv.wakeOne();
 
-    return newJob;
+    int threads = available;
+    for (auto it = groups.constBegin(); it != groups.constEnd(); it++) {
+        if (!it.key().isEmpty())
+            threads -= it.value()->maxThreads();
+    }
+    return qMax(threads, 1);
 }
 
+// Share threads out again after a named group was added or resized, unless the default
+// group's threads were set explicitly. Only valid on GUI thread.
+void ImageLoaderPrivate::updateDefaultThreads()
+{
+    ImageLoader *loader = groups.value(QString());
+    if (!loader || loader->d->maxThreadsSet)
+        return;
+    loader->d->applyMaxThreads(defaultThreadCount(QString()));
+}
+
+// Start another worker if there is more work queued than idle workers to take it. Must hold mutex.
 void ImageLoaderPrivate::startWorkers()
 {
-    workers.clear();
-    workers.emplace_back(&ImageLoaderPrivate::worker, this);
-    for (unsigned int i = 1; i < std::thread::hardware_concurrency() - 1; i++) {
-        workers.emplace_back(&ImageLoaderPrivate::worker, this);
+    while (!stopping && threadCount < maxThreads && int(queue.size()) > idleThreads) {
+        threadCount++;
+        std::thread(&ImageLoaderPrivate::worker, this).detach();
+        // The new worker will take one of the queued tasks
+        idleThreads++;
+        qCDebug(lcImageLoad) << "started worker" << threadCount << "of" << maxThreads;
+    }
+}
+
+// Lower the scheduling class of the calling worker thread, and limit it to the CPUs
+// in SPEEDYIMAGE_LOADER_CPUS
+static void setWorkerScheduling()
+{
+#ifdef Q_OS_LINUX
+    static const QByteArray policy = qgetenv("SPEEDYIMAGE_LOADER_SCHED");
+    static const int niceValue = qEnvironmentVariableIsSet("SPEEDYIMAGE_LOADER_NICE") ? qgetenv("SPEEDYIMAGE_LOADER_NICE").toInt() : 5;
+
+    if (policy != "normal") {
+        sched_param param = {};
+        int sched = policy == "idle" ? SCHED_IDLE : SCHED_BATCH;
+        if (pthread_setschedparam(pthread_self(), sched, &param) != 0)
+            qCDebug(lcImageLoad) << "cannot set worker scheduling policy";
+        // On Linux, the nice value of a thread is set by its thread id
+        if (sched == SCHED_BATCH && niceValue)
+            setpriority(PRIO_PROCESS, id_t(syscall(SYS_gettid)), niceValue);
     }
-    qCDebug(lcImageLoad) << workers.size() << "workers started";
+
+    static const cpu_set_t *cpus = []() -> cpu_set_t* {
+        QByteArray list = qgetenv("SPEEDYIMAGE_LOADER_CPUS");
+        if (list.isEmpty())
+            return nullptr;
+        auto set = new cpu_set_t;
+        CPU_ZERO(set);
+        for (const QByteArray &range : list.split(',')) {
+            QList<QByteArray> bounds = range.trimmed().split('-');
+            int first = bounds.value(0).toInt();
+            int last = bounds.size() > 1 ? bounds.value(1).toInt() : first;
+            for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+                CPU_SET(cpu, set);
+        }
+        return set;
+    }();
+    if (cpus && pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), cpus) != 0)
+        qCDebug(lcImageLoad) << "cannot set worker affinity";
+#endif
 }
 
 void ImageLoaderPrivate::worker()
 {
+    setWorkerScheduling();
+
+    // New workers are already counted as idle by startWorkers
+    bool idle = true;
     for (;;) {
         QMutexLocker l(&mutex);
-        while (!stopping && queue.empty()) {
-            cv.wait(&mutex);
+        if (!idle)
+            idleThreads++;
+        idle = false;
+
+        bool timedOut = false;
+        while (!stopping && queue.empty() && !timedOut && threadCount <= maxThreads) {
+            unsigned long timeout = idleTimeout >= 0 ? ulong(idleTimeout) : ULONG_MAX;
+            timedOut = !cv.wait(&mutex, timeout) && queue.empty();
         }
-        if (stopping) {
-            break;
+        idleThreads--;
+
+        // Exit when stopping, after being idle for too long, or if there are too many workers
+        if (stopping || queue.empty() || threadCount > maxThreads) {
+            threadCount--;
+            qCDebug(lcImageLoad) << "worker exiting," << threadCount << "remaining";
+            threadsExited.wakeAll();
+            return;
         }
-        JobDataList jobData = queue.front();
-        queue.pop_front();
+        TaskPtr task = startNext();
         l.unlock();
+        startReads();
+        runTask(task);
+    }
+}
 
-        QImageReader rd;
-        rd.setAutoTransform(true);
-        QSize drawSize, imageSize;
+// Take the task at the front of the queue to run it. Must be called with the mutex held.
+ImageLoaderPrivate::TaskPtr ImageLoaderPrivate::startNext()
+{
+    TaskPtr task = queuePop();
+    if (pending.value(task->path) == task)
+        pending.remove(task->path);
+    task->running = true;
+    task->seenQueueChanges = queueChanges.loadAcquire();
+    running.insert(task->path, task);
+    if (task->readingAhead) {
+        task->readingAhead = false;
+        readsAhead--;
+    }
+    queueReads();
+    return task;
+}
 
-        // jobData is a vector of weak pointers to ImageLoaderJobData representing the same file
-        for (auto &weakJob : jobData) {
-            auto job = weakJob.lock();
-            if (!job) {
-                // aborted
-                continue;
-            }
+// Start reading files for the first tasks in the queue, so they are in memory by the time a
+// worker takes them. Tasks that may be found in the disk or shared cache are not read ahead,
+// unless they are loading at full size. Must be called with the mutex held, and followed by
+// startReads once it's unlocked.
+void ImageLoaderPrivate::queueReads()
+{
+    if (readsAhead >= readAhead || queue.empty())
+        return;
 
-            if (rd.fileName().isEmpty()) {
-                rd.setFileName(job->path);
-            }
+    // Visit the first readAhead tasks in queue order by walking the heap from its root
+    std::vector<size_t> next { 0 };
+    for (int visited = 0; visited < readAhead && readsAhead < readAhead && !next.empty(); visited++) {
+        auto best = next.begin();
+        for (auto it = next.begin(); it != next.end(); it++) {
+            if (runsBefore(queue[*it].get(), queue[*best].get()))
+                best = it;
+        }
+        size_t i = *best;
+        next.erase(best);
+        if (2 * i + 1 < queue.size())
+            next.push_back(2 * i + 1);
+        if (2 * i + 2 < queue.size())
+            next.push_back(2 * i + 2);
 
-            // If only one dimension of drawSize is set, read image size to calculate the other by aspect
-            QSize jobDrawSize = job->drawSize;
-            if (jobDrawSize.isEmpty() && (jobDrawSize.width() > 0 || jobDrawSize.height() > 0)) {
-                if (!imageSize.isValid()) {
-                    imageSize = rd.size();
-                }
-                if (imageSize.isEmpty()) {
-                    // Indicates that the plugin can't read size ahead of decoding, which should only
-                    // be third party plugins. In this case we can't be smart about scaling anyway, so
-                    // just make drawSize infinite.
-                    jobDrawSize = QSize(0, 0);
-                } else if (jobDrawSize.width() > 0) {
-                    // Calculate height by width
-                    double f = double(jobDrawSize.width()) / double(imageSize.width());
-                    jobDrawSize = QSize(jobDrawSize.width(), qRound(imageSize.height() * f));
-                } else {
-                    // Width by height
-                    double f = double(jobDrawSize.height()) / double(imageSize.height());
-                    jobDrawSize = QSize(qRound(imageSize.width() * f), jobDrawSize.height());
-                }
-            }
+        const TaskPtr &task = queue[i];
+        if (task->readingAhead || (persistentCache && !task->isFullSize()))
+            continue;
+        task->readingAhead = true;
+        readsAhead++;
+        readsToStart.push_back(task);
+    }
+}
+
+// Start the reads chosen by queueReads, without holding the mutex while FileReader takes its
+// own lock and wakes its thread. Reads of tasks that started running meanwhile are dropped,
+// and the worker reads the file itself.
+void ImageLoaderPrivate::startReads()
+{
+    QMutexLocker l(&mutex);
+    if (readsToStart.empty())
+        return;
+    std::vector<TaskPtr> tasks;
+    tasks.swap(readsToStart);
+    l.unlock();
+
+    std::vector<FileRead> reads;
+    reads.reserve(tasks.size());
+    for (const TaskPtr &task : tasks)
+        reads.push_back(FileReader::instance()->read(task->path));
+
+    l.relock();
+    for (size_t i = 0; i < tasks.size(); i++) {
+        if (tasks[i]->readingAhead)
+            tasks[i]->read = reads[i];
+    }
+    l.unlock();
+}
+
+void ImageLoaderPrivate::runTask(const TaskPtr &task)
+{
+    QMutexLocker l(&mutex);
+    JobDataList jobData = task->jobs;
+    FileRead read = task->read;
+    task->read = FileRead();
+    l.unlock();
+
+    // The file is read by FileReader, and decoded from memory. It's only needed once the
+    // caches have missed, unless the size of the image is needed to find the draw size and
+    // it isn't in the metadata index.
+    QImageReader rd;
+    rd.setAutoTransform(true);
+    QBuffer buffer;
+    QString error;
+    auto openFile = [&]() -> bool {
+        if (buffer.isOpen())
+            return true;
+        if (read.isNull())
+            read = FileReader::instance()->read(task->path, true);
+        QByteArray data = read.wait(&error);
+        if (data.isNull())
+            return false;
+        buffer.setData(data);
+        buffer.open(QIODevice::ReadOnly);
+        rd.setDevice(&buffer);
+        return true;
+    };
+
+    bool live = false;
+    QSize drawSize, imageSize;
+    ImageMetadataIndex *metadataIndex = ImageMetadataIndex::instance();
+
+    // jobData is a vector of weak pointers to ImageLoaderJobData representing the same file
+    for (auto &weakJob : jobData) {
+        auto job = weakJob.lock();
+        if (!job) {
+            // aborted
+            continue;
+        }
+        live = true;
 
-            // Now max the potentially-modified jobDrawSize with drawSize
-            if (jobDrawSize.isEmpty()) {
-                // Full size
-                drawSize = QSize(0, 0); // Valid, but empty; unset is invalid
-            } else if (!drawSize.isValid() || !drawSize.isEmpty()) {
-                // All other cases, except when drawSize is already set to empty for full size
-                drawSize = QSize(qMax(drawSize.width(), jobDrawSize.width()), qMax(drawSize.height(), jobDrawSize.height()));
+        // If only one dimension of drawSize is set, read image size to calculate the other by aspect
+        QSize jobDrawSize = job->drawSize;
+        if (jobDrawSize.isEmpty() && (jobDrawSize.width() > 0 || jobDrawSize.height() > 0)) {
+            if (!imageSize.isValid() && metadataIndex) {
+                imageSize = metadataIndex->imageSize(task->path);
+            }
+            if (!imageSize.isValid() && openFile()) {
+                imageSize = rd.size();
+            }
+            if (imageSize.isEmpty()) {
+                // Indicates that the plugin can't read size ahead of decoding, which should only
+                // be third party plugins. In this case we can't be smart about scaling anyway, so
+                // just make drawSize infinite.
+                jobDrawSize = QSize(0, 0);
+            } else if (jobDrawSize.width() > 0) {
+                // Calculate height by width
+                double f = double(jobDrawSize.width()) / double(imageSize.width());
+                jobDrawSize = QSize(jobDrawSize.width(), qRound(imageSize.height() * f));
+            } else {
+                // Width by height
+                double f = double(jobDrawSize.height()) / double(imageSize.height());
+                jobDrawSize = QSize(qRound(imageSize.width() * f), jobDrawSize.height());
             }
         }
 
-        if (rd.fileName().isEmpty()) {
-            // Job aborted
-            continue;
+        // Now max the potentially-modified jobDrawSize with drawSize
+        if (jobDrawSize.isEmpty()) {
+            // Full size
+            drawSize = QSize(0, 0); // Valid, but empty; unset is invalid
+        } else if (!drawSize.isValid() || !drawSize.isEmpty()) {
+            // All other cases, except when drawSize is already set to empty for full size
+            drawSize = QSize(qMax(drawSize.width(), jobDrawSize.width()), qMax(drawSize.height(), jobDrawSize.height()));
+        }
+    }
+
+    if (!live) {
+        // Job aborted
+        l.relock();
+        if (running.value(task->path) == task)
+            running.remove(task->path);
+        return;
+    }
+
+    // From this point, new jobs for the path can join this task if drawSize is large enough
+    l.relock();
+    task->drawSize = drawSize;
+    task->imageSize = imageSize;
+    l.unlock();
+
+    // Thumbnails can be served from the shared or disk cache without decoding. Full size
+    // loads are never cached, because the source is already the best copy of those.
+    QImage image;
+    ImageDiskCache *diskCache = ImageDiskCache::instance();
+#ifdef SPEEDYIMAGE_HAVE_SHARED_CACHE
+    ImageSharedCache *sharedCache = ImageSharedCache::instance();
+#endif
+    bool cached = false;
+    if (!drawSize.isEmpty()) {
+#ifdef SPEEDYIMAGE_HAVE_SHARED_CACHE
+        cached = sharedCache && sharedCache->lookup(task->path, drawSize, image, imageSize);
+#endif
+        if (!cached && diskCache && diskCache->lookup(task->path, drawSize, image, imageSize)) {
+            cached = true;
+#ifdef SPEEDYIMAGE_HAVE_SHARED_CACHE
+            if (sharedCache)
+                sharedCache->insert(task->path, drawSize, image, imageSize);
+#endif
         }
+    }
+
+    if (!cached && !openFile()) {
+        qCDebug(lcImageLoad) << "error reading" << task->path << error;
+    } else if (!cached) {
+        // Use an embedded thumbnail if it's large enough, or deliver it as a preview
+        QImage thumbnail;
+        bool usePreview = previews.loadAcquire();
+        if (!drawSize.isEmpty() || usePreview)
+            thumbnail = readThumbnail(rd, buffer.data(), imageSize);
 
-        QString error;
-        auto result = std::make_shared<QImage>(readImage(rd, drawSize, imageSize, error));
-        for (auto &weakJob : jobData) {
-            auto job = weakJob.lock();
-            if (!job) {
-                continue;
+        if (!thumbnail.isNull() && !drawSize.isEmpty() && coversDrawSize(thumbnail.size(), imageSize, drawSize)) {
+            qCDebug(lcImageLoad) << "using embedded thumbnail for" << task->path << "at" << thumbnail.size() << "with draw size" << drawSize;
+            image = convertToUploadFormat(thumbnail);
+        } else {
+            if (!thumbnail.isNull() && usePreview) {
+                qCDebug(lcImageLoad) << "delivering preview for" << task->path << "at" << thumbnail.size();
+                deliver(task, std::make_shared<QImage>(convertToUploadFormat(thumbnail)), imageSize, QString(), true);
             }
-            job->result = result;
-            job->resultSize = imageSize;
-            job->error = error;
-            if (job->callback) {
-                job->callback(ImageLoaderJob(job));
+            image = readImage(rd, buffer.data(), drawSize, imageSize, error, task);
+            if (task->cancelled) {
+                qCDebug(lcImageLoad) << "cancelled loading" << task->path;
+                return;
             }
         }
+
+        // Record what was learned from the header, so the next load knows it up front
+        if (metadataIndex && !imageSize.isEmpty()) {
+            ImageMetadata metadata;
+            metadata.size = imageSize;
+            metadata.transform = rd.transformation();
+            metadata.format = rd.format();
+            metadataIndex->insert(task->path, metadata);
+        }
+
+        if (!drawSize.isEmpty() && !image.isNull() && image.size() != imageSize) {
+#ifdef SPEEDYIMAGE_HAVE_SHARED_CACHE
+            if (sharedCache)
+                sharedCache->insert(task->path, drawSize, image, imageSize);
+#endif
+            if (diskCache)
+                diskCache->insert(task->path, drawSize, image, imageSize);
+        }
+    } else {
+        // The caches may be shared with builds for another Qt version, which upload differently
+        image = convertToUploadFormat(image);
     }
+
+    deliver(task, std::make_shared<QImage>(image), imageSize, error, false);
 }
 
-QImage ImageLoaderPrivate::readImage(QImageReader &rd, const QSize &drawSize, QSize &imageSize, QString &error)
+// Called between chunks of decoding. Returns true if the task has no jobs left, in which
+// case it is marked as cancelled and can't be joined anymore. If a task with much higher
+// priority is waiting and no other worker can take it, it runs first on this thread.
+//
+// The mutex is only taken when jobs of the task changed or a task was queued since the last
+// check.
+bool ImageLoaderPrivate::interrupted(const TaskPtr &task)
 {
+    bool jobsChanged = task->jobsChanged.fetchAndStoreOrdered(0);
+    int changes = queueChanges.loadAcquire();
+    bool queueChanged = changes != task->seenQueueChanges;
+    if (!jobsChanged && !queueChanged)
+        return false;
+    task->seenQueueChanges = changes;
+
+    QMutexLocker l(&mutex);
+    if (!task->hasLiveJobs()) {
+        task->cancelled = true;
+        if (running.value(task->path) == task)
+            running.remove(task->path);
+        return true;
+    }
+
+    // Only one task is suspended per thread, so that the first can always finish
+    if (!queueChanged || preemptPriority <= 0 || suspendedTasks > 0 || stopping || queue.empty())
+        return false;
+    if (idleThreads > 0 || threadCount < maxThreads)
+        return false;
+    if (queue.front()->priority < task->priority + preemptPriority)
+        return false;
+    if (!suspendedWorkers.testAndSetOrdered(0, 1))
+        return false;
+
+    TaskPtr next = startNext();
+    l.unlock();
+    startReads();
+    qCDebug(lcImageLoad) << "suspending" << task->path << "to load" << next->path;
+    suspendedTasks++;
+    runTask(next);
+    suspendedTasks--;
+    suspendedWorkers.storeRelease(0);
+    return false;
+}
+
+void ImageLoaderPrivate::deliver(const TaskPtr &task, const std::shared_ptr<QImage> &result, const QSize &imageSize,
+                                 const QString &error, bool preview)
+{
+    // Jobs may have been cancelled or joined while loading
+    QMutexLocker l(&mutex);
+    if (!preview && running.value(task->path) == task)
+        running.remove(task->path);
+    JobDataList jobData = task->jobs;
+    l.unlock();
+
+    for (auto &weakJob : jobData) {
+        auto job = weakJob.lock();
+        if (!job) {
+            continue;
+        }
+        QMutexLocker resultLock(&job->resultMutex);
+        job->result = result;
+        job->resultSize = imageSize;
+        job->error = error;
+        job->preview = preview;
+        resultLock.unlock();
+        if (job->callback) {
+            job->callback(ImageLoaderJob(job));
+        }
+    }
+}
+
+// Returns true if an image of size is large enough to draw imageSize within drawSize
+static bool coversDrawSize(const QSize &size, const QSize &imageSize, const QSize &drawSize)
+{
+    if (size == imageSize)
+        return true;
+    if (drawSize.isEmpty() || imageSize.isEmpty())
+        return false;
+    QSize needed = imageSize.scaled(drawSize, Qt::KeepAspectRatio);
+    return size.width() >= needed.width() && size.height() >= needed.height();
+}
+
+// Read the thumbnail embedded in a JPEG file, oriented to match the image. Thumbnails that
+// don't match the aspect ratio of the image (usually because they are letterboxed) are ignored.
+QImage ImageLoaderPrivate::readThumbnail(QImageReader &rd, const QByteArray &data, QSize &imageSize)
+{
+    if (rd.format() != "jpeg")
+        return QImage();
+
+    int searchSize = qMin(data.size(), embeddedThumbnailSearchSize);
+    QImage thumbnail = readEmbeddedThumbnail(QByteArray::fromRawData(data.constData(), searchSize));
+    if (thumbnail.isNull())
+        return QImage();
+
     imageSize = rd.size();
     auto transform = rd.transformation();
     if (transform & QImageIOHandler::TransformationRotate90)
         imageSize = QSize(imageSize.height(), imageSize.width());
+    thumbnail = applyTransformation(thumbnail, transform);
 
-    if (!drawSize.isEmpty() && (drawSize.width() < imageSize.width() || drawSize.height() < imageSize.height())) {
-        // Downscaling; pick next factor of two size for most efficient decoding. Calculation may not be ideal.
-        qreal factor = qMin(imageSize.width() / drawSize.width(), imageSize.height() / drawSize.height());
-
-        if (factor >= 16) {
-            factor = 16;
-        } else if (factor >= 8) {
-            factor = 8;
-        } else if (factor >= 4) {
-            factor = 4;
-        } else if (factor >= 2) {
-            factor = 2;
-        } else {
-            factor = 1;
-        }
+    if (imageSize.isEmpty() || qAbs(double(thumbnail.width()) / thumbnail.height() - double(imageSize.width()) / imageSize.height()) > 0.02)
+        return QImage();
+    return thumbnail;
+}
+
+QImage ImageLoaderPrivate::readImage(QImageReader &rd, const QByteArray &data, const QSize &drawSize, QSize &imageSize,
+                                     QString &error, const TaskPtr &task)
+{
+    imageSize = rd.size();
+    auto transform = rd.transformation();
+    if (transform & QImageIOHandler::TransformationRotate90)
+        imageSize = QSize(imageSize.height(), imageSize.width());
+
+    // The exact size the image will be drawn at, or invalid for full size
+    QSize targetSize;
+    if (!drawSize.isEmpty() && !imageSize.isEmpty())
+        targetSize = imageSize.scaled(drawSize, Qt::KeepAspectRatio).boundedTo(imageSize);
 
-        // This is only really more efficient to load for JPEG, but smaller textures are a good thing long term
-        if (factor > 1) {
-            qCDebug(lcImageLoad) << "Using sw scaling for" << imageSize << "->" << drawSize << "at factor" << factor;
-            // Be careful to not use imageSize, it may have been transformed
-            rd.setScaledSize(rd.size() / factor);
+    // JPEG and PNG are decoded directly when possible, scaling line by line as they are
+    // decoded. Anything else, or anything those decoders reject, falls back to QImageReader.
+    // Memory is reserved until the image has been scaled and converted for upload.
+    QImage image;
+    std::unique_ptr<DecodeMemoryReservation> reservation;
+#ifdef SPEEDYIMAGE_HAVE_LIBJPEG
+    if (rd.format() == "jpeg")
+        image = readJpeg(data, targetSize, transform, task);
+#endif
+#ifdef SPEEDYIMAGE_HAVE_LIBPNG
+    if (rd.format() == "png")
+        image = readPng(data, targetSize, transform, task);
+#endif
+    if (task->cancelled)
+        return QImage();
+
+    if (image.isNull()) {
+        if (!drawSize.isEmpty() && (drawSize.width() < imageSize.width() || drawSize.height() < imageSize.height())) {
+            // Downscaling; pick next factor of two size for most efficient decoding. Calculation may not be ideal.
+            qreal factor = qMin(imageSize.width() / drawSize.width(), imageSize.height() / drawSize.height());
+
+            if (factor >= 16) {
+                factor = 16;
+            } else if (factor >= 8) {
+                factor = 8;
+            } else if (factor >= 4) {
+                factor = 4;
+            } else if (factor >= 2) {
+                factor = 2;
+            } else {
+                factor = 1;
+            }
+
+            // Only formats that can scale while decoding are given a scaled size. For others,
+            // QImageReader would decode at full size and then scale slowly; those are scaled
+            // by ImageScaler below.
+            if (factor > 1 && rd.supportsOption(QImageIOHandler::ScaledSize)) {
+                qCDebug(lcImageLoad) << "Using sw scaling for" << imageSize << "->" << drawSize << "at factor" << factor;
+                // Be careful to not use imageSize, it may have been transformed
+                rd.setScaledSize(rd.size() / factor);
+            }
         }
+
+        // QImageReader can't be interrupted, so this is the last chance to stop
+        if (interrupted(task))
+            return QImage();
+
+        // The whole image is decoded at once, so wait until there is memory for it, for a
+        // converted copy made while scaling or converting for upload, and for the result
+        QSize decodeSize = rd.scaledSize().isValid() ? rd.scaledSize() : rd.size();
+        reservation.reset(new DecodeMemoryReservation(2 * imageBytes(decodeSize) + imageBytes(targetSize)));
+        image = rd.read();
+    } else {
+        // The decoders reserved memory for their own work, which is over. Transforming or
+        // converting the result makes a copy of it.
+        reservation.reset(new DecodeMemoryReservation(imageBytes(image.size())));
     }
 
-    QImage image = rd.read();
     if (!imageSize.isValid())
         imageSize = image.size();
 
+    // Bring the decoded image down to exactly the size it will be drawn at
+    if (!image.isNull() && !drawSize.isEmpty() && !imageSize.isEmpty()) {
+        targetSize = imageSize.scaled(drawSize, Qt::KeepAspectRatio).boundedTo(image.size());
+        if (!targetSize.isEmpty() && targetSize != image.size()) {
+            QImage scaled = ImageScaler::scaled(image, targetSize);
+            if (!scaled.isNull()) {
+                qCDebug(lcImageLoad) << "Scaled" << image.size() << "to" << targetSize;
+                image = scaled;
+            }
+        }
+    }
+
     if (image.isNull()) {
         error = rd.errorString();
-        qCDebug(lcImageLoad) << "error loading" << rd.fileName() << error;
+        qCDebug(lcImageLoad) << "error loading" << task->path << error;
     } else {
-        qCDebug(lcImageLoad) << "loaded" << rd.fileName() << imageSize << "at" << image.size() << "with draw size" << drawSize;
+        qCDebug(lcImageLoad) << "loaded" << task->path << imageSize << "at" << image.size() << "with draw size" << drawSize;
     }
 
-    return image;
+    // Any conversion for upload happens here rather than on the thread creating textures
+    return convertToUploadFormat(image);
+}
+
+// Estimated memory for a decoded image; zero if the size is unknown
+static qint64 imageBytes(const QSize &size)
+{
+    return size.isEmpty() ? 0 : qint64(size.width()) * size.height() * 4;
+}
+
+// Decode lines into an image of targetSize, given in the orientation of the file. When the
+// decoder's output is larger, lines are scaled as they are decoded, and only a few lines of
+// the output size are held in memory. Between chunks of lines, the decode stops if the task
+// was cancelled, or is suspended to run more important tasks. Returns a null image on failure.
+template<typename Decoder>
+QImage ImageLoaderPrivate::decodeLines(Decoder &decoder, const QSize &outputSize, const QSize &targetSize, qint64 sourceBytes,
+                                       const TaskPtr &task)
+{
+    const int chunk = 16;
+    uchar *rows[chunk];
+
+    if (targetSize.isEmpty() || targetSize == outputSize) {
+        DecodeMemoryReservation reservation(imageBytes(outputSize) + sourceBytes);
+        QImage image(outputSize, decoder.outputFormat());
+        if (image.isNull() || !decoder.start())
+            return QImage();
+
+        while (decoder.currentLine() < image.height()) {
+            if (interrupted(task))
+                return QImage();
+            int count = qMin(chunk, image.height() - decoder.currentLine());
+            for (int i = 0; i < count; i++)
+                rows[i] = image.scanLine(decoder.currentLine() + i);
+            if (decoder.readLines(rows, count) < 1)
+                return QImage();
+        }
+        return image;
+    }
+
+    ImageScaler scaler(outputSize, targetSize, decoder.outputFormat());
+    if (!scaler.isValid())
+        return QImage();
+
+    DecodeMemoryReservation reservation(imageBytes(targetSize) + imageBytes(QSize(outputSize.width(), chunk * 3)) + sourceBytes);
+    QImage buffer(outputSize.width(), chunk, decoder.outputFormat());
+    if (buffer.isNull() || !decoder.start())
+        return QImage();
+
+    for (int i = 0; i < chunk; i++)
+        rows[i] = buffer.scanLine(i);
+    while (decoder.currentLine() < outputSize.height()) {
+        if (interrupted(task))
+            return QImage();
+        int count = decoder.readLines(rows, qMin(chunk, outputSize.height() - decoder.currentLine()));
+        if (count < 1)
+            return QImage();
+        for (int i = 0; i < count; i++)
+            scaler.addLine(buffer.constScanLine(i));
+    }
+
+    qCDebug(lcImageLoad) << "Scaled" << outputSize << "to" << targetSize << "while decoding";
+    return scaler.result();
+}
+
+#ifdef SPEEDYIMAGE_HAVE_LIBJPEG
+// Decode with the smallest DCT scale that covers targetSize, and scale the rest of the way
+// while decoding. Returns a null image if the file can't be decoded by JpegDecoder, so that
+// QImageReader can try.
+QImage ImageLoaderPrivate::readJpeg(const QByteArray &data, const QSize &targetSize,
+                                    QImageIOHandler::Transformations transform, const TaskPtr &task)
+{
+    JpegDecoder decoder(reinterpret_cast<const uchar*>(data.constData()), size_t(data.size()));
+    if (!decoder.readHeader())
+        return QImage();
+
+    // The decoder works in the orientation of the file, before transformation
+    QSize fileTargetSize = targetSize;
+    if (transform & QImageIOHandler::TransformationRotate90)
+        fileTargetSize.transpose();
+    QSize outputSize = decoder.setMinimumOutputSize(fileTargetSize);
+    qCDebug(lcImageLoad) << "Using libjpeg scaling for" << decoder.size() << "->" << fileTargetSize << "at" << outputSize;
+
+    QImage image = decodeLines(decoder, outputSize, fileTargetSize, data.size(), task);
+    decoder.finish();
+    if (image.isNull()) {
+        if (!task->cancelled)
+            qCDebug(lcImageLoad) << "libjpeg failed for" << task->path << decoder.errorString();
+        return QImage();
+    }
+    return applyTransformation(image, transform);
+}
+#endif
+
+#ifdef SPEEDYIMAGE_HAVE_LIBPNG
+// Decode non-interlaced PNG line by line, scaling to targetSize while decoding. Returns a
+// null image if the file can't be decoded by PngDecoder, so that QImageReader can try.
+QImage ImageLoaderPrivate::readPng(const QByteArray &data, const QSize &targetSize,
+                                   QImageIOHandler::Transformations transform, const TaskPtr &task)
+{
+    PngDecoder decoder(reinterpret_cast<const uchar*>(data.constData()), size_t(data.size()));
+    if (!decoder.readHeader())
+        return QImage();
+
+    QSize fileTargetSize = targetSize;
+    if (transform & QImageIOHandler::TransformationRotate90)
+        fileTargetSize.transpose();
+
+    QImage image = decodeLines(decoder, decoder.size(), fileTargetSize, data.size(), task);
+    if (image.isNull()) {
+        if (!task->cancelled)
+            qCDebug(lcImageLoad) << "libpng failed for" << task->path << decoder.errorString();
+        return QImage();
+    }
+    return applyTransformation(image, transform);
+}
+#endif
+
+DecodeMemoryReservation::DecodeMemoryReservation(qint64 bytes)
+    : bytes(bytes)
+{
+    ImageLoaderPrivate::reserveDecodeMemory(bytes);
+}
+
+DecodeMemoryReservation::~DecodeMemoryReservation()
+{
+    ImageLoaderPrivate::releaseDecodeMemory(bytes);
+}
+
+qint64 ImageLoaderPrivate::decodeMemoryLimit()
+{
+    static const qint64 limit = []() -> qint64 {
+        qint64 bytes = qgetenv("SPEEDYIMAGE_DECODE_MEMORY").toLongLong();
+        return bytes > 0 ? bytes : 256 * 1048576;
+    }();
+    return limit;
+}
+
+// Wait until bytes fit within the decode memory limit. A decode larger than the limit is
+// allowed to run alone, rather than never running at all.
+//
+// A worker that already holds a reservation doesn't wait, because others may be waiting for
+// it. The exception is a task run while another is suspended: it waits for the memory held
+// by other workers, which all run to completion because only one worker may suspend a task,
+// but not for the memory of the suspended task, which would be waiting for itself.
+void ImageLoaderPrivate::reserveDecodeMemory(qint64 bytes)
+{
+    QMutexLocker l(&decodeMemoryMutex);
+    auto mustWait = [bytes]() {
+        if (decodeMemory + bytes <= decodeMemoryLimit())
+            return false;
+        if (suspendedTasks > 0)
+            return decodeMemory - threadReservedBytes > 0;
+        return threadReservations == 0 && decodeMemory > 0;
+    };
+    while (mustWait()) {
+        qCDebug(lcImageLoad) << "waiting for" << bytes << "bytes of decode memory, with" << decodeMemory << "in use";
+        decodeMemoryCv.wait(&decodeMemoryMutex);
+    }
+    decodeMemory += bytes;
+    threadReservations++;
+    threadReservedBytes += bytes;
+}
+
+void ImageLoaderPrivate::releaseDecodeMemory(qint64 bytes)
+{
+    QMutexLocker l(&decodeMemoryMutex);
+    decodeMemory -= bytes;
+    threadReservations--;
+    threadReservedBytes -= bytes;
+    l.unlock();
+    decodeMemoryCv.wakeAll();
 }
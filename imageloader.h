@@ -3,26 +3,42 @@
 #include <QObject>
 #include <QLoggingCategory>
 #include <QImage>
+#include <QMutex>
+#include <QStringList>
+#include <QVector>
 #include <QWaitCondition>
 #include <memory>
 #include <functional>
 
 class ImageLoaderJob;
+class ImageLoaderPrivate;
+struct ImageLoaderTask;
 using ImageLoaderCallback = std::function<void(const ImageLoaderJob &)>;
 
 // ImageLoaderJob is a strong reference to a pending or completed job for an ImageLoader.
 // Jobs are reference counted, and will be aborted if no references remain when the job
-// reaches the front of the queue.
+// reaches the front of the queue, or while it is being decoded.
 struct ImageLoaderJobData
 {
+    ~ImageLoaderJobData();
+
     QString path;
     QSize drawSize;
     int priority;
     ImageLoaderCallback callback;
 
+    // The result is written by a worker while other threads may read it, so it's only
+    // accessed under resultMutex
+    QMutex resultMutex;
     std::shared_ptr<QImage> result;
     QSize resultSize;
     QString error;
+    // Set if result is a preview and the final result will follow
+    bool preview = false;
+
+    // Owned by the loader and only accessed under its mutex
+    std::weak_ptr<ImageLoaderPrivate> loader;
+    std::weak_ptr<ImageLoaderTask> task;
 };
 
 class ImageLoaderJob
@@ -48,10 +64,19 @@ public:
         if (d) d->drawSize = size;
     }
 
-    bool finished() const { return d ? (d->result || !d->error.isEmpty()) : false; }
-    QImage result() const { return d && d->result ? *d->result : QImage(); }
-    QSize imageSize() const { return d ? d->resultSize : QSize(); }
-    QString error() const { return d ? d->error : QString(); }
+    // Change the priority of a pending job. Jobs with higher priority are loaded first. Once
+    // a worker has started loading the job, the priority only decides if it is preempted.
+    void setPriority(int priority);
+
+    // Remove this job from the queue. The callback will not be called unless loading
+    // has already finished. Other jobs for the same path are unaffected.
+    void cancel();
+
+    bool finished() const;
+    bool isPreview() const;
+    QImage result() const;
+    QSize imageSize() const;
+    QString error() const;
 
 private:
     std::shared_ptr<ImageLoaderJobData> d;
@@ -71,19 +96,78 @@ private:
     }
 };
 
-class ImageLoaderPrivate;
 class ImageLoader : public QObject
 {
     Q_OBJECT
+    Q_PROPERTY(int maxThreads READ maxThreads WRITE setMaxThreads NOTIFY maxThreadsChanged)
+    Q_PROPERTY(int idleTimeout READ idleTimeout WRITE setIdleTimeout NOTIFY idleTimeoutChanged)
 
 public:
     explicit ImageLoader(QObject *parent = nullptr);
     virtual ~ImageLoader();
 
+    // The default loader used by SpeedyImage, which is available to QML as the ImageLoader
+    // singleton
+    static ImageLoader *instance();
+
+    // Loaders for each SpeedyImage::loaderGroup have their own queue and workers, so that
+    // slow loads in one group never delay another. The default loader is the group with an
+    // empty name. Only valid on GUI thread.
+    static ImageLoader *forGroup(const QString &group);
+    Q_INVOKABLE ImageLoader *group(const QString &group) const { return forGroup(group); }
+    QString groupName() const;
+
+    // Results are in the format the scene graph uploads without conversion; see uploadformat.h.
+    //
+    // Jobs with higher priority are loaded first. Pending jobs age while they wait, so that
+    // low priority jobs are not starved by a constant stream of higher priority work.
+    //
+    // If the image has an embedded thumbnail large enough for drawSize, it will be used instead
+    // of decoding the image. Otherwise, when previews are enabled, the callback is called first
+    // with the embedded thumbnail as a preview result, and again when the image is loaded.
     ImageLoaderJob enqueue(const QString &path, const QSize &drawSize, int priority, ImageLoaderCallback callback);
 
+    // Enqueue jobs for many paths at once, taking the lock and waking workers only once, for
+    // prefetching. Each job is the same as one from enqueue for its path.
+    QVector<ImageLoaderJob> enqueue(const QStringList &paths, const QSize &drawSize, int priority,
+                                    ImageLoaderCallback callback);
+
+    // Enabled by default, unless SPEEDYIMAGE_PREVIEWS is set to 0
+    bool previewsEnabled() const;
+    void setPreviewsEnabled(bool enabled);
+
+    // Workers are started as needed up to maxThreads. The threads available to all groups
+    // are set by SPEEDYIMAGE_LOADER_THREADS, or are one less than the number of CPUs
+    // available to the process, considering its affinity and the quota in cpu.max of its
+    // cgroup. Named groups use SPEEDYIMAGE_LOADER_THREADS_<GROUP>, with the group name in
+    // upper case, or half of the available threads. The default group has what the named
+    // groups leave, at least one, unless maxThreads is set on it.
+    //
+    // Workers run with SCHED_BATCH and a nice value of 5, to leave the CPU to the GUI and
+    // render threads. SPEEDYIMAGE_LOADER_SCHED may be set to "idle" for SCHED_IDLE or
+    // "normal" to keep the default scheduling, and SPEEDYIMAGE_LOADER_NICE sets the nice
+    // value. SPEEDYIMAGE_LOADER_CPUS limits workers to a list of CPUs like "2-5,7", for
+    // example to keep them away from the core of the render thread.
+    //
+    // Workers decode from memory, and files are read by FileReader. Files for the first
+    // SPEEDYIMAGE_READ_AHEAD (default 8) queued tasks are read ahead, so that I/O depth and
+    // decode parallelism can be tuned separately.
+    int maxThreads() const;
+    void setMaxThreads(int maxThreads);
+
+    // Milliseconds a worker waits without work before exiting, set by
+    // SPEEDYIMAGE_LOADER_IDLE (default 30000). Workers never exit if it's negative.
+    int idleTimeout() const;
+    void setIdleTimeout(int timeout);
+
+signals:
+    void maxThreadsChanged();
+    void idleTimeoutChanged();
+
 private:
     std::shared_ptr<ImageLoaderPrivate> d;
+
+    ImageLoader(const QString &group, QObject *parent);
 };
 
 Q_DECLARE_LOGGING_CATEGORY(lcImageLoad)
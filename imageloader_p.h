@@ -1,27 +1,168 @@
 #pragma once
 
 #include "imageloader.h"
-#include <deque>
-#include <thread>
+#include "filereader.h"
+#include <vector>
+#include <QHash>
 #include <QMutex>
+#include <QElapsedTimer>
 #include <QImageReader>
 
+using ImageLoaderJobDataList = QVector<std::weak_ptr<ImageLoaderJobData>>;
+
+// ImageLoaderTask is a single load of a file in the queue, delivering its result to
+// one or more jobs. All members are protected by the loader's mutex.
+struct ImageLoaderTask
+{
+    QString path;
+    ImageLoaderJobDataList jobs;
+
+    // Highest priority of any job in the task
+    int priority = 0;
+    // Time of enqueue on the loader's clock, used for aging
+    qint64 enqueuedAt = 0;
+    // Position in the queue order; see ImageLoaderPrivate::updateRank
+    qint64 rank = 0;
+    quint64 seq = 0;
+    // Index in ImageLoaderPrivate::queue, or -1 if not queued
+    int heapIndex = -1;
+    // Set while the task is queued and counted in readsAhead. The read of the file is set
+    // once it has started, outside of the mutex.
+    bool readingAhead = false;
+    // Contents of the file, if it's being read ahead while the task is queued
+    FileRead read;
+
+    // Set by the worker once loading has started. drawSize is invalid until it is known.
+    bool running = false;
+    QSize drawSize;
+    QSize imageSize;
+    // Set by the worker if all jobs went away while decoding
+    bool cancelled = false;
+    // Set when a job is cancelled or released, so that the worker checks for live jobs.
+    // Read without the mutex.
+    QAtomicInt jobsChanged;
+    // Value of ImageLoaderPrivate::queueChanges when the worker last checked for preemption,
+    // only used by the worker
+    int seenQueueChanges = 0;
+
+    bool isFullSize() const;
+    bool hasLiveJobs() const;
+    bool covers(const QSize &drawSize) const;
+};
+
+class ImageLoaderPrivate;
+
+// Holds memory for a decode against the process-wide limit for its lifetime
+class DecodeMemoryReservation
+{
+public:
+    explicit DecodeMemoryReservation(qint64 bytes);
+    ~DecodeMemoryReservation();
+
+private:
+    qint64 bytes;
+};
+
 class ImageLoaderPrivate
 {
 public:
-    using JobDataList = QVector<std::weak_ptr<ImageLoaderJobData>>;
+    using JobDataList = ImageLoaderJobDataList;
+    using TaskPtr = std::shared_ptr<ImageLoaderTask>;
 
-    ImageLoaderPrivate(ImageLoader *q);
+    ImageLoaderPrivate(ImageLoader *q, const QString &group);
     virtual ~ImageLoaderPrivate();
 
+    static QHash<QString,ImageLoader*> groups;
+
     ImageLoader *q;
+    const QString group;
     QMutex mutex;
     QWaitCondition cv;
     bool stopping;
-    std::deque<JobDataList> queue;
-    std::vector<std::thread> workers;
 
+    // Workers are detached threads, started on demand and exiting when idle
+    int maxThreads;
+    // Set once maxThreads was set explicitly, rather than shared out by defaultThreadCount
+    bool maxThreadsSet;
+    int threadCount;
+    int idleThreads;
+    int idleTimeout;
+    QWaitCondition threadsExited;
+
+    // Binary max-heap of pending tasks ordered by rank
+    std::vector<TaskPtr> queue;
+    // Changed whenever a task may have become urgent enough to preempt a running task, so
+    // that workers only take the mutex to check when it has changed
+    QAtomicInt queueChanges;
+    QElapsedTimer clock;
+    quint64 nextSeq;
+
+    // Tasks for each path that are waiting in the queue or being loaded by a worker
+    QHash<QString,TaskPtr> pending;
+    QHash<QString,TaskPtr> running;
+    // Milliseconds of waiting that are worth one level of priority
+    int agingInterval;
+    QAtomicInt previews;
+    // Levels of priority above a running task at which a waiting task preempts it, from
+    // SPEEDYIMAGE_LOADER_PREEMPT (default 32). Preemption is disabled if it's not positive.
+    int preemptPriority;
+
+    // Files read ahead for queued tasks are limited to SPEEDYIMAGE_READ_AHEAD (default 8).
+    // The number of reads in flight at once is set by FileReader.
+    int readAhead;
+    int readsAhead;
+    // Tasks chosen to read ahead, waiting for startReads
+    std::vector<TaskPtr> readsToStart;
+    bool persistentCache;
+
+    void queuePush(const TaskPtr &task);
+    TaskPtr queuePop();
+    void queueRemove(ImageLoaderTask *task);
+    void queueUpdate(ImageLoaderTask *task);
+    void siftUp(size_t i);
+    void siftDown(size_t i);
+    void updateRank(ImageLoaderTask *task);
+    void updatePriority(ImageLoaderTask *task);
+
+    void queueReads();
+    void startReads();
+
+    void enqueueJob(const std::shared_ptr<ImageLoaderJobData> &job);
+    void setJobPriority(ImageLoaderJobData *job, int priority);
+    void cancelJob(ImageLoaderJobData *job);
+
+    static int availableThreads();
+    static int defaultThreadCount(const QString &group);
+    static void updateDefaultThreads();
+    void applyMaxThreads(int threads);
     void startWorkers();
     void worker();
-    QImage readImage(QImageReader &rd, const QSize &drawSize, QSize &imageSize, QString &error);
+    TaskPtr startNext();
+    void runTask(const TaskPtr &task);
+    bool interrupted(const TaskPtr &task);
+    void deliver(const TaskPtr &task, const std::shared_ptr<QImage> &result, const QSize &imageSize, const QString &error, bool preview);
+    QImage readThumbnail(QImageReader &rd, const QByteArray &data, QSize &imageSize);
+    QImage readImage(QImageReader &rd, const QByteArray &data, const QSize &drawSize, QSize &imageSize, QString &error,
+                     const TaskPtr &task);
+    template<typename Decoder>
+    QImage decodeLines(Decoder &decoder, const QSize &outputSize, const QSize &targetSize, qint64 sourceBytes,
+                       const TaskPtr &task);
+#ifdef SPEEDYIMAGE_HAVE_LIBJPEG
+    QImage readJpeg(const QByteArray &data, const QSize &targetSize,
+                    QImageIOHandler::Transformations transform, const TaskPtr &task);
+#endif
+#ifdef SPEEDYIMAGE_HAVE_LIBPNG
+    QImage readPng(const QByteArray &data, const QSize &targetSize,
+                   QImageIOHandler::Transformations transform, const TaskPtr &task);
+#endif
+
+    // Bytes of memory in use by decodes of all loader groups, limited by
+    // SPEEDYIMAGE_DECODE_MEMORY (default 256MB)
+    static QMutex decodeMemoryMutex;
+    static QWaitCondition decodeMemoryCv;
+    static qint64 decodeMemory;
+
+    static qint64 decodeMemoryLimit();
+    static void reserveDecodeMemory(qint64 bytes);
+    static void releaseDecodeMemory(qint64 bytes);
 };
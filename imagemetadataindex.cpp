@@ -0,0 +1,324 @@
+#include "imagemetadataindex_p.h"
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QLoggingCategory>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+Q_LOGGING_CATEGORY(lcMetadata, "speedyimage.metadata")
+
+ImageMetadataIndex *ImageMetadataIndex::instance()
+{
+    static ImageMetadataIndex *index = []() -> ImageMetadataIndex* {
+        if (qgetenv("SPEEDYIMAGE_METADATA_INDEX") == "0")
+            return nullptr;
+
+        int maxEntries = 200000;
+        if (qEnvironmentVariableIsSet("SPEEDYIMAGE_METADATA_INDEX_SIZE"))
+            maxEntries = qgetenv("SPEEDYIMAGE_METADATA_INDEX_SIZE").toInt();
+        if (maxEntries < 1)
+            return nullptr;
+
+        QString fileName = QString::fromLocal8Bit(qgetenv("SPEEDYIMAGE_METADATA_INDEX_PATH"));
+        if (fileName.isEmpty())
+            fileName = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + QStringLiteral("/speedyimage-metadata");
+        if (!QDir().mkpath(QFileInfo(fileName).absolutePath())) {
+            qCWarning(lcMetadata) << "cannot create directory for metadata index" << fileName;
+            return nullptr;
+        }
+
+        qCDebug(lcMetadata) << "using metadata index" << fileName << "with up to" << maxEntries << "entries";
+        return new ImageMetadataIndex(fileName, maxEntries);
+    }();
+    return index;
+}
+
+// The index is never destroyed, so the thread loading it can't outlive it
+ImageMetadataIndex::ImageMetadataIndex(const QString &fileName, int maxEntries)
+    : d(new ImageMetadataIndexPrivate(fileName, maxEntries))
+{
+    std::thread(&ImageMetadataIndexPrivate::load, d.get()).detach();
+}
+
+ImageMetadataIndex::~ImageMetadataIndex()
+{
+}
+
+ImageMetadataIndexPrivate::ImageMetadataIndexPrivate(const QString &fileName, int maxEntries)
+    : fileName(fileName)
+    , maxEntries(maxEntries)
+    , loaded(false)
+    , nextSeq(0)
+    , records(0)
+    , compacting(false)
+    , pendingRecordCount(0)
+{
+}
+
+QString ImageMetadataIndex::fileName() const
+{
+    return d->fileName;
+}
+
+int ImageMetadataIndex::count() const
+{
+    QMutexLocker l(&d->mutex);
+    return d->entries.size();
+}
+
+bool ImageMetadataIndex::lookup(const QString &path, ImageMetadata &metadata)
+{
+    QFileInfo info(path);
+    if (!info.isFile())
+        return false;
+    return lookup(info.absoluteFilePath(), info.lastModified().toMSecsSinceEpoch(), info.size(), metadata);
+}
+
+bool ImageMetadataIndex::lookup(const QString &absolutePath, qint64 modified, qint64 fileSize, ImageMetadata &metadata)
+{
+    QMutexLocker l(&d->mutex);
+    auto it = d->entries.constFind(absolutePath);
+    if (it == d->entries.constEnd() || it->modified != modified || it->fileSize != fileSize)
+        return false;
+    metadata = it->metadata;
+    return true;
+}
+
+QSize ImageMetadataIndex::imageSize(const QString &path)
+{
+    ImageMetadata metadata;
+    if (!lookup(path, metadata))
+        return QSize();
+    return metadata.size;
+}
+
+QSize ImageMetadataIndex::recordedImageSize(const QString &path)
+{
+    // Only makes the path absolute, without a stat
+    QString key = QFileInfo(path).absoluteFilePath();
+    QMutexLocker l(&d->mutex);
+    return d->entries.value(key).metadata.size;
+}
+
+void ImageMetadataIndex::insert(const QString &path, const ImageMetadata &metadata)
+{
+    if (!metadata.isValid())
+        return;
+    QFileInfo info(path);
+    if (!info.isFile())
+        return;
+    QString key = info.absoluteFilePath();
+
+    ImageMetadataIndexPrivate::Entry entry;
+    entry.modified = info.lastModified().toMSecsSinceEpoch();
+    entry.fileSize = info.size();
+    entry.metadata = metadata;
+
+    QMutexLocker l(&d->mutex);
+    if (!d->loaded) {
+        d->pendingInserts.append(qMakePair(key, entry));
+        return;
+    }
+
+    auto it = d->entries.constFind(key);
+    if (it != d->entries.constEnd() && it->modified == entry.modified && it->fileSize == entry.fileSize &&
+        it->metadata.size == metadata.size && it->metadata.transform == metadata.transform &&
+        it->metadata.format == metadata.format)
+    {
+        return;
+    }
+
+    entry.seq = d->nextSeq++;
+    d->entries.insert(key, entry);
+    QByteArray record = ImageMetadataIndexPrivate::record(key, entry);
+    if (record.isEmpty())
+        return;
+    if (d->compacting) {
+        d->pendingRecords += record;
+        d->pendingRecordCount++;
+    } else if (d->file.isOpen() && d->file.write(record) == record.size()) {
+        d->records++;
+    }
+
+    if (!d->compacting && d->needsCompaction()) {
+        QByteArray data = d->compactedData();
+        l.unlock();
+        std::thread(&ImageMetadataIndexPrivate::writeCompacted, d.get(), data).detach();
+    }
+}
+
+// Full indexes are trimmed by an eighth at once, so that they're not rewritten every time
+bool ImageMetadataIndexPrivate::needsCompaction() const
+{
+    return records > 2 * entries.size() + 1024 || entries.size() > maxEntries + maxEntries / 8;
+}
+
+// Read the index file, on a background thread. A file that is missing, from another version,
+// or that ends in a partial record is rewritten from the valid entries.
+void ImageMetadataIndexPrivate::load()
+{
+    QHash<QString,Entry> loadedEntries;
+    quint64 loadedSeq = 0;
+    int loadedRecords = 0;
+
+    QFile in(fileName);
+    QByteArray data;
+    if (in.open(QIODevice::ReadOnly))
+        data = in.readAll();
+    in.close();
+
+    bool valid = data.size() >= int(sizeof(FileHeader));
+    if (valid) {
+        FileHeader header;
+        memcpy(&header, data.constData(), sizeof(header));
+        valid = header.magic == fileMagic && header.version == fileVersion;
+    }
+
+    qint64 offset = sizeof(FileHeader);
+    while (valid && offset < data.size()) {
+        RecordHeader header;
+        if (offset + qint64(sizeof(header)) > data.size()) {
+            valid = false;
+            break;
+        }
+        memcpy(&header, data.constData() + offset, sizeof(header));
+        const char *path = data.constData() + offset + sizeof(header);
+        qint64 end = offset + qint64(sizeof(header)) + header.pathLength + header.formatLength;
+        if (header.magic != recordMagic || end > data.size()) {
+            valid = false;
+            break;
+        }
+
+        Entry entry;
+        entry.modified = header.modified;
+        entry.fileSize = header.fileSize;
+        entry.metadata.size = QSize(header.width, header.height);
+        entry.metadata.transform = QImageIOHandler::Transformations(QFlag(header.transform));
+        entry.metadata.format = QByteArray(path + header.pathLength, header.formatLength);
+        entry.seq = loadedSeq++;
+        loadedEntries.insert(QString::fromUtf8(path, header.pathLength), entry);
+        loadedRecords++;
+        offset = end;
+    }
+    data.clear();
+
+    QMutexLocker l(&mutex);
+    entries.swap(loadedEntries);
+    nextSeq = loadedSeq;
+    records = loadedRecords;
+    loaded = true;
+    qCDebug(lcMetadata) << "loaded" << entries.size() << "entries from" << records << "records";
+
+    // Inserts made meanwhile are newer than anything in the file
+    QVector<QPair<QString,Entry>> inserts;
+    inserts.swap(pendingInserts);
+    for (const auto &insert : inserts) {
+        Entry entry = insert.second;
+        entry.seq = nextSeq++;
+        entries.insert(insert.first, entry);
+        QByteArray record = ImageMetadataIndexPrivate::record(insert.first, entry);
+        if (!record.isEmpty()) {
+            pendingRecords += record;
+            pendingRecordCount++;
+        }
+    }
+
+    if (!valid || needsCompaction() || entries.size() > maxEntries) {
+        QByteArray compacted = compactedData();
+        l.unlock();
+        writeCompacted(compacted);
+        return;
+    }
+    openForAppend();
+}
+
+// Trim the entries and serialize them for rewriting the file, holding the mutex. Records
+// inserted until the file is written are appended to the new file.
+QByteArray ImageMetadataIndexPrivate::compactedData()
+{
+    file.close();
+    compacting = true;
+    // Already in the new file
+    pendingRecords.clear();
+    pendingRecordCount = 0;
+
+    std::vector<std::pair<quint64,QString>> order;
+    order.reserve(size_t(entries.size()));
+    for (auto it = entries.constBegin(); it != entries.constEnd(); it++)
+        order.emplace_back(it->seq, it.key());
+    std::sort(order.begin(), order.end());
+    size_t drop = order.size() > size_t(maxEntries) ? order.size() - size_t(maxEntries) : 0;
+    for (size_t i = 0; i < drop; i++)
+        entries.remove(order[i].second);
+
+    FileHeader header;
+    header.magic = fileMagic;
+    header.version = fileVersion;
+    QByteArray data(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (size_t i = drop; i < order.size(); i++)
+        data += record(order[i].second, entries.value(order[i].second));
+
+    records = entries.size();
+    return data;
+}
+
+// Write the compacted file without holding the mutex, on a background thread
+void ImageMetadataIndexPrivate::writeCompacted(const QByteArray &data)
+{
+    QSaveFile out(fileName);
+    bool written = out.open(QIODevice::WriteOnly) && out.write(data) == data.size() && out.commit();
+
+    QMutexLocker l(&mutex);
+    compacting = false;
+    if (!written) {
+        qCWarning(lcMetadata) << "cannot write metadata index" << fileName << out.errorString();
+        pendingRecords.clear();
+        pendingRecordCount = 0;
+        return;
+    }
+    qCDebug(lcMetadata) << "rewrote metadata index with" << records << "entries";
+    openForAppend();
+}
+
+// Holding the mutex
+void ImageMetadataIndexPrivate::openForAppend()
+{
+    file.setFileName(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Unbuffered)) {
+        qCWarning(lcMetadata) << "cannot write metadata index" << fileName << file.errorString();
+    } else if (!pendingRecords.isEmpty() && file.write(pendingRecords) == pendingRecords.size()) {
+        records += pendingRecordCount;
+    }
+    pendingRecords.clear();
+    pendingRecordCount = 0;
+}
+
+// Each record is written at once, so that records appended by other processes don't mix
+QByteArray ImageMetadataIndexPrivate::record(const QString &path, const Entry &entry)
+{
+    QByteArray pathData = path.toUtf8();
+    const QByteArray &format = entry.metadata.format;
+    if (pathData.size() > 0xffff || format.size() > 0xff)
+        return QByteArray();
+
+    RecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = recordMagic;
+    header.pathLength = quint16(pathData.size());
+    header.formatLength = quint8(format.size());
+    header.transform = quint8(int(entry.metadata.transform));
+    header.modified = entry.modified;
+    header.fileSize = entry.fileSize;
+    header.width = entry.metadata.size.width();
+    header.height = entry.metadata.size.height();
+
+    QByteArray data(reinterpret_cast<const char*>(&header), sizeof(header));
+    data += pathData;
+    data += format;
+    return data;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <QByteArray>
+#include <QImageIOHandler>
+#include <QSize>
+#include <QString>
+#include <memory>
+
+class ImageMetadataIndexPrivate;
+
+struct ImageMetadata
+{
+    // Size of the image after applying its orientation
+    QSize size;
+    QImageIOHandler::Transformations transform = QImageIOHandler::TransformationNone;
+    QByteArray format;
+
+    bool isValid() const { return !size.isEmpty(); }
+};
+
+// ImageMetadataIndex is a persistent index of the size, orientation and format of images,
+// keyed by the path, modification time and size of the file. ImageLoader records images
+// as it reads them, so that the size of an image that was seen before is known before it
+// loads, without opening the file.
+//
+// The index is kept in memory and appended to a file, which is SPEEDYIMAGE_METADATA_INDEX_PATH
+// or speedyimage-metadata under the application's cache location. It's loaded on a background
+// thread when the index is first used, and lookups miss until then. It's rewritten on a
+// background thread without duplicate or old entries when it has grown to twice the size of
+// the index. At most SPEEDYIMAGE_METADATA_INDEX_SIZE (default 200000) entries are kept,
+// dropping the oldest. Setting SPEEDYIMAGE_METADATA_INDEX=0 disables the index.
+//
+// All functions are thread-safe and never wait for the disk while holding the index. Lookups
+// and inserts stat the file, which may block on network filesystems, so the GUI thread should
+// only use recordedImageSize.
+class ImageMetadataIndex
+{
+public:
+    // Returns the process-wide index, or nullptr if it is disabled
+    static ImageMetadataIndex *instance();
+
+    ~ImageMetadataIndex();
+
+    // Find metadata for path, if the file has not changed since it was recorded
+    bool lookup(const QString &path, ImageMetadata &metadata);
+    // For callers that have already stat'ed the file. The path must be absolute and clean,
+    // and modified is in msecs since the epoch.
+    bool lookup(const QString &absolutePath, qint64 modified, qint64 fileSize, ImageMetadata &metadata);
+    QSize imageSize(const QString &path);
+    // Size recorded for path without checking that the file is unchanged, which doesn't touch
+    // the disk. It's only a hint until the image loads, because the file may have changed.
+    QSize recordedImageSize(const QString &path);
+
+    void insert(const QString &path, const ImageMetadata &metadata);
+
+    QString fileName() const;
+    int count() const;
+
+private:
+    std::unique_ptr<ImageMetadataIndexPrivate> d;
+
+    ImageMetadataIndex(const QString &fileName, int maxEntries);
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "imagemetadataindex.h"
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QVector>
+
+class ImageMetadataIndexPrivate
+{
+public:
+    struct Entry
+    {
+        qint64 modified;
+        qint64 fileSize;
+        ImageMetadata metadata;
+        // Order of insertion, to drop the oldest entries when the index is full
+        quint64 seq;
+    };
+
+    // The index file is a FileHeader followed by records, each a RecordHeader followed by
+    // the path in UTF-8 and the format. Later records for a path replace earlier ones.
+    struct FileHeader
+    {
+        quint32 magic;
+        quint32 version;
+    };
+
+    struct RecordHeader
+    {
+        quint32 magic;
+        quint16 pathLength;
+        quint8 formatLength;
+        quint8 transform;
+        qint64 modified;
+        qint64 fileSize;
+        qint32 width;
+        qint32 height;
+    };
+
+    static const quint32 fileMagic = 0x53494d49; // SIMI
+    static const quint32 fileVersion = 1;
+    static const quint32 recordMagic = 0x53494d52; // SIMR
+
+    ImageMetadataIndexPrivate(const QString &fileName, int maxEntries);
+
+    const QString fileName;
+    const int maxEntries;
+
+    // Protects everything below
+    QMutex mutex;
+    // The file is read on a background thread, and lookups miss until it's loaded
+    bool loaded;
+    QHash<QString,Entry> entries;
+    quint64 nextSeq;
+    // Records in the file, including replaced ones
+    int records;
+    // Open for appending after load, and closed while the file is rewritten
+    QFile file;
+    bool compacting;
+    // Inserts made before the file was loaded
+    QVector<QPair<QString,Entry>> pendingInserts;
+    // Records to append once the file is open again after load or compaction
+    QByteArray pendingRecords;
+    int pendingRecordCount;
+
+    void load();
+    bool needsCompaction() const;
+    QByteArray compactedData();
+    void writeCompacted(const QByteArray &data);
+    void openForAppend();
+    static QByteArray record(const QString &path, const Entry &entry);
+};
@@ -0,0 +1,340 @@
+#include "imagescaler.h"
+#include <cstring>
+#include <vector>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SPEEDYIMAGE_SCALER_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Filter weights are fixed point, and the weights for each output pixel sum to exactly
+// 1 << weightBits. Horizontal sums are stored with 8 fractional bits, which keeps vertical
+// sums within 32 bits.
+const int weightBits = 14;
+const int horizontalShift = weightBits - 8;
+const int verticalShift = weightBits + 8;
+
+struct Filter
+{
+    int start;
+    int count;
+    int weightOffset;
+};
+
+struct FilterTable
+{
+    std::vector<Filter> filters;
+    std::vector<quint32> weights;
+
+    const quint32 *weightsFor(int i) const { return weights.data() + filters[size_t(i)].weightOffset; }
+};
+
+// Coordinates are scaled so that a source pixel is targetSize wide and an output pixel is
+// sourceSize wide, making every overlap an integer.
+FilterTable makeFilter(int sourceSize, int targetSize)
+{
+    FilterTable table;
+    table.filters.reserve(size_t(targetSize));
+    table.weights.reserve(size_t(sourceSize) + size_t(targetSize));
+
+    for (int x = 0; x < targetSize; x++) {
+        qint64 begin = qint64(x) * sourceSize;
+        qint64 end = begin + sourceSize;
+        int first = int(begin / targetSize);
+        int last = int((end - 1) / targetSize);
+        table.filters.push_back(Filter{first, last - first + 1, int(table.weights.size())});
+
+        qint64 covered = 0;
+        quint32 previous = 0;
+        for (int i = first; i <= last; i++) {
+            covered += qMin(end, qint64(i + 1) * targetSize) - qMax(begin, qint64(i) * targetSize);
+            quint32 cumulative = quint32((covered << weightBits) / sourceSize);
+            table.weights.push_back(cumulative - previous);
+            previous = cumulative;
+        }
+    }
+
+    return table;
+}
+
+using HorizontalFunction = void (*)(quint32 *out, const uchar *in, const FilterTable &table);
+using AccumulateFunction = void (*)(quint32 *acc, const quint32 *line, quint32 weight, int count);
+using StoreFunction = void (*)(uchar *out, const quint32 *acc, int count);
+
+template<int Channels>
+void horizontalScalar(quint32 *out, const uchar *in, const FilterTable &table)
+{
+    for (size_t x = 0; x < table.filters.size(); x++) {
+        const Filter &f = table.filters[x];
+        const quint32 *w = table.weights.data() + f.weightOffset;
+        const uchar *p = in + size_t(f.start) * Channels;
+
+        quint32 sum[Channels] = {};
+        for (int i = 0; i < f.count; i++) {
+            for (int c = 0; c < Channels; c++)
+                sum[c] += p[i * Channels + c] * w[i];
+        }
+        for (int c = 0; c < Channels; c++)
+            out[x * Channels + c] = sum[c] >> horizontalShift;
+    }
+}
+
+void accumulateScalar(quint32 *acc, const quint32 *line, quint32 weight, int count)
+{
+    for (int i = 0; i < count; i++)
+        acc[i] += line[i] * weight;
+}
+
+void storeScalar(uchar *out, const quint32 *acc, int count)
+{
+    const quint32 round = 1u << (verticalShift - 1);
+    for (int i = 0; i < count; i++)
+        out[i] = uchar(qMin<quint32>((acc[i] + round) >> verticalShift, 255));
+}
+
+#ifdef SPEEDYIMAGE_SCALER_X86
+// One pixel of 4 channels per 128-bit vector
+__attribute__((target("sse4.1")))
+void horizontalSse41(quint32 *out, const uchar *in, const FilterTable &table)
+{
+    for (size_t x = 0; x < table.filters.size(); x++) {
+        const Filter &f = table.filters[x];
+        const quint32 *w = table.weights.data() + f.weightOffset;
+        const uchar *p = in + size_t(f.start) * 4;
+
+        __m128i sum = _mm_setzero_si128();
+        for (int i = 0; i < f.count; i++) {
+            int pixel;
+            memcpy(&pixel, p + i * 4, 4);
+            __m128i v = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(pixel));
+            sum = _mm_add_epi32(sum, _mm_mullo_epi32(v, _mm_set1_epi32(int(w[i]))));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x * 4), _mm_srli_epi32(sum, horizontalShift));
+    }
+}
+
+__attribute__((target("sse4.1")))
+void accumulateSse41(quint32 *acc, const quint32 *line, quint32 weight, int count)
+{
+    const __m128i w = _mm_set1_epi32(int(weight));
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i));
+        __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(acc + i), _mm_add_epi32(a, _mm_mullo_epi32(l, w)));
+    }
+    accumulateScalar(acc + i, line + i, weight, count - i);
+}
+
+__attribute__((target("avx2")))
+void accumulateAvx2(quint32 *acc, const quint32 *line, quint32 weight, int count)
+{
+    const __m256i w = _mm256_set1_epi32(int(weight));
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + i));
+        __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(line + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + i), _mm256_add_epi32(a, _mm256_mullo_epi32(l, w)));
+    }
+    accumulateScalar(acc + i, line + i, weight, count - i);
+}
+
+__attribute__((target("sse4.1")))
+void storeSse41(uchar *out, const quint32 *acc, int count)
+{
+    const __m128i round = _mm_set1_epi32(1 << (verticalShift - 1));
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i v[4];
+        for (int j = 0; j < 4; j++) {
+            v[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i + j * 4));
+            v[j] = _mm_srli_epi32(_mm_add_epi32(v[j], round), verticalShift);
+        }
+        __m128i lo = _mm_packus_epi32(v[0], v[1]);
+        __m128i hi = _mm_packus_epi32(v[2], v[3]);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_packus_epi16(lo, hi));
+    }
+    storeScalar(out + i, acc + i, count - i);
+}
+
+bool cpuHasSse41()
+{
+    static const bool result = __builtin_cpu_supports("sse4.1");
+    return result;
+}
+
+bool cpuHasAvx2()
+{
+    static const bool result = __builtin_cpu_supports("avx2");
+    return result;
+}
+#endif
+
+int channelsForFormat(QImage::Format format)
+{
+    switch (format) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+        return 4;
+    case QImage::Format_RGB888:
+        return 3;
+    case QImage::Format_Grayscale8:
+    case QImage::Format_Alpha8:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+} // namespace
+
+class ImageScalerPrivate
+{
+public:
+    QSize sourceSize;
+    QSize targetSize;
+    int channels;
+
+    FilterTable horizontal;
+    FilterTable vertical;
+    HorizontalFunction horizontalFn;
+    AccumulateFunction accumulateFn;
+    StoreFunction storeFn;
+
+    int sourceLine;
+    // Horizontally scaled source line, and accumulators for the two output lines a source
+    // line can contribute to
+    std::vector<quint32> line;
+    std::vector<quint32> accumulators[2];
+    QImage result;
+};
+
+ImageScaler::ImageScaler(const QSize &sourceSize, const QSize &targetSize, QImage::Format format)
+    : d(new ImageScalerPrivate)
+{
+    d->sourceSize = sourceSize;
+    d->targetSize = targetSize;
+    d->channels = channelsForFormat(format);
+    d->sourceLine = 0;
+    d->horizontalFn = nullptr;
+    d->accumulateFn = accumulateScalar;
+    d->storeFn = storeScalar;
+
+    if (sourceSize.isEmpty() || targetSize.isEmpty() || !d->channels ||
+        targetSize.width() > sourceSize.width() || targetSize.height() > sourceSize.height())
+    {
+        return;
+    }
+
+    d->result = QImage(targetSize, format);
+    if (d->result.isNull())
+        return;
+
+    d->horizontal = makeFilter(sourceSize.width(), targetSize.width());
+    d->vertical = makeFilter(sourceSize.height(), targetSize.height());
+
+    size_t lineSize = size_t(targetSize.width()) * d->channels;
+    d->line.resize(lineSize);
+    d->accumulators[0].resize(lineSize);
+    d->accumulators[1].resize(lineSize);
+
+    switch (d->channels) {
+    case 4: d->horizontalFn = horizontalScalar<4>; break;
+    case 3: d->horizontalFn = horizontalScalar<3>; break;
+    default: d->horizontalFn = horizontalScalar<1>; break;
+    }
+
+#ifdef SPEEDYIMAGE_SCALER_X86
+    if (cpuHasSse41()) {
+        if (d->channels == 4)
+            d->horizontalFn = horizontalSse41;
+        d->accumulateFn = accumulateSse41;
+        d->storeFn = storeSse41;
+    }
+    if (cpuHasAvx2())
+        d->accumulateFn = accumulateAvx2;
+#endif
+}
+
+ImageScaler::~ImageScaler()
+{
+}
+
+bool ImageScaler::supportsFormat(QImage::Format format)
+{
+    return channelsForFormat(format) > 0;
+}
+
+bool ImageScaler::isValid() const
+{
+    return d->horizontalFn != nullptr;
+}
+
+QSize ImageScaler::sourceSize() const
+{
+    return d->sourceSize;
+}
+
+QSize ImageScaler::targetSize() const
+{
+    return d->targetSize;
+}
+
+int ImageScaler::linesAdded() const
+{
+    return d->sourceLine;
+}
+
+void ImageScaler::addLine(const uchar *sourceLine)
+{
+    if (!isValid() || d->sourceLine >= d->sourceSize.height())
+        return;
+
+    const int j = d->sourceLine++;
+    const int count = int(d->line.size());
+    d->horizontalFn(d->line.data(), sourceLine, d->horizontal);
+
+    // Source line j overlaps the output lines containing its first and last edge, which
+    // are the same line or adjacent lines when downscaling.
+    const qint64 sourceHeight = d->sourceSize.height(), targetHeight = d->targetSize.height();
+    const int firstY = int((j * targetHeight) / sourceHeight);
+    const int lastY = int(((j + 1) * targetHeight - 1) / sourceHeight);
+
+    for (int y = firstY; y <= lastY; y++) {
+        const Filter &f = d->vertical.filters[size_t(y)];
+        quint32 *acc = d->accumulators[y & 1].data();
+        if (j == f.start)
+            std::fill(acc, acc + count, 0u);
+
+        d->accumulateFn(acc, d->line.data(), d->vertical.weightsFor(y)[j - f.start], count);
+
+        if (j == f.start + f.count - 1)
+            d->storeFn(d->result.scanLine(y), acc, count);
+    }
+}
+
+QImage ImageScaler::result() const
+{
+    if (!isValid() || d->sourceLine < d->sourceSize.height())
+        return QImage();
+    return d->result;
+}
+
+QImage ImageScaler::scaled(const QImage &image, const QSize &targetSize)
+{
+    QImage source = image;
+    if (!supportsFormat(source.format()))
+        source = source.convertToFormat(source.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+
+    ImageScaler scaler(source.size(), targetSize, source.format());
+    if (!scaler.isValid())
+        return QImage();
+
+    for (int y = 0; y < source.height(); y++)
+        scaler.addLine(source.constScanLine(y));
+    return scaler.result();
+}
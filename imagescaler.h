@@ -0,0 +1,41 @@
+#pragma once
+
+#include <QImage>
+#include <memory>
+
+class ImageScalerPrivate;
+
+// ImageScaler downscales images with an area-averaging (box) filter, where each output
+// pixel is the exact weighted average of the source pixels it covers. The source is
+// consumed line by line, so an image can be scaled while it is being decoded, using
+// memory proportional to the output rather than the source.
+//
+// Formats with 1, 3 or 4 bytes per pixel are scaled directly; see supportsFormat. Alpha
+// must be premultiplied to be averaged correctly. SSE4.1 and AVX2 are used when the CPU
+// supports them.
+class ImageScaler
+{
+public:
+    // targetSize must not be larger than sourceSize in either dimension
+    ImageScaler(const QSize &sourceSize, const QSize &targetSize, QImage::Format format);
+    ~ImageScaler();
+
+    static bool supportsFormat(QImage::Format format);
+
+    bool isValid() const;
+    QSize sourceSize() const;
+    QSize targetSize() const;
+
+    // Add the next line of the source image, in the format given to the constructor
+    void addLine(const uchar *line);
+    // Number of source lines added so far
+    int linesAdded() const;
+    // Returns the scaled image once all source lines have been added
+    QImage result() const;
+
+    // Scale a complete image. Unsupported formats are converted first.
+    static QImage scaled(const QImage &image, const QSize &targetSize);
+
+private:
+    std::unique_ptr<ImageScalerPrivate> d;
+};
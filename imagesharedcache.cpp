@@ -0,0 +1,488 @@
+#include "imagesharedcache_p.h"
+#include "imagediskcache.h"
+#include <QCryptographicHash>
+#include <QLoggingCategory>
+#include <QThread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+Q_LOGGING_CATEGORY(lcSharedCache, "speedyimage.sharedcache")
+
+// Atomics in the segment are used by several processes, which is only possible without locks
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "shared cache requires lock-free atomics");
+
+ImageSharedCache *ImageSharedCache::instance()
+{
+    static ImageSharedCache *cache = []() -> ImageSharedCache* {
+        qint64 size = qgetenv("SPEEDYIMAGE_SHARED_CACHE_SIZE").toLongLong();
+        if (size < 1)
+            return nullptr;
+
+        QString name = QString::fromLocal8Bit(qgetenv("SPEEDYIMAGE_SHARED_CACHE_NAME"));
+        if (name.isEmpty())
+            name = QStringLiteral("speedyimage-%1").arg(::getuid());
+
+        auto dp = ImageSharedCachePrivate::attach(name, size);
+        if (!dp)
+            return nullptr;
+        qCDebug(lcSharedCache) << "using shared cache" << name << "with size" << dp->header->size
+                               << "and" << dp->header->slotCount << "slots";
+        return new ImageSharedCache(dp);
+    }();
+    return cache;
+}
+
+ImageSharedCache::ImageSharedCache(ImageSharedCachePrivate *dp)
+    : d(dp)
+{
+}
+
+// The segment stays mapped for the life of the process, because images may still use it
+ImageSharedCache::~ImageSharedCache()
+{
+}
+
+QString ImageSharedCache::name() const
+{
+    return d->name;
+}
+
+qint64 ImageSharedCache::size() const
+{
+    return qint64(d->header->size);
+}
+
+// Open or create the segment. The process creating it initializes the header, and others
+// wait for that to finish before using it.
+ImageSharedCachePrivate *ImageSharedCachePrivate::attach(const QString &name, qint64 size)
+{
+    QByteArray shmName = '/' + name.toLocal8Bit();
+    bool created = true;
+    int fd = ::shm_open(shmName.constData(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        created = false;
+        fd = ::shm_open(shmName.constData(), O_RDWR | O_CLOEXEC, 0);
+    }
+    if (fd < 0) {
+        qCWarning(lcSharedCache) << "cannot open shared cache" << name << strerror(errno);
+        return nullptr;
+    }
+
+    if (created) {
+        if (::ftruncate(fd, off_t(size)) != 0) {
+            qCWarning(lcSharedCache) << "cannot resize shared cache" << name << strerror(errno);
+            ::close(fd);
+            ::shm_unlink(shmName.constData());
+            return nullptr;
+        }
+    } else {
+        // The segment keeps the size it was created with
+        struct stat st;
+        for (int i = 0; i < 100; i++) {
+            if (::fstat(fd, &st) != 0 || st.st_size > 0)
+                break;
+            QThread::msleep(10);
+        }
+        size = st.st_size;
+    }
+
+    if (size < qint64(sizeof(SegmentHeader))) {
+        qCWarning(lcSharedCache) << "shared cache" << name << "is too small";
+        ::close(fd);
+        return nullptr;
+    }
+
+    void *base = ::mmap(nullptr, size_t(size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        qCWarning(lcSharedCache) << "cannot map shared cache" << name << strerror(errno);
+        return nullptr;
+    }
+
+    auto header = static_cast<SegmentHeader*>(base);
+    if (created) {
+        // A new segment is zero-filled, which is an empty slot for every slot
+        quint64 slotCount = qBound<quint64>(64, quint64(size) / (16 * 1024), 65536);
+        quint64 dataOffset = (sizeof(SegmentHeader) + slotCount * sizeof(Slot) + 4095) & ~quint64(4095);
+        if (dataOffset >= quint64(size)) {
+            qCWarning(lcSharedCache) << "shared cache size" << size << "is too small";
+            ::munmap(base, size_t(size));
+            ::shm_unlink(shmName.constData());
+            return nullptr;
+        }
+
+        header->magic = segmentMagic;
+        header->version = segmentVersion;
+        header->slotCount = quint32(slotCount);
+        header->size = quint64(size);
+        header->dataOffset = dataOffset;
+        header->dataSize = quint64(size) - dataOffset;
+        header->head = 0;
+
+        // Robust, so that a process dying while holding the mutex doesn't block the others
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&header->mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        header->initialized.store(1, std::memory_order_release);
+    } else {
+        for (int i = 0; i < 100 && !header->initialized.load(std::memory_order_acquire); i++)
+            QThread::msleep(10);
+
+        if (!header->initialized.load(std::memory_order_acquire) ||
+            header->magic != segmentMagic || header->version != segmentVersion ||
+            header->size != quint64(size) || header->dataOffset >= header->size)
+        {
+            qCWarning(lcSharedCache) << "shared cache" << name << "is incompatible or not initialized";
+            ::munmap(base, size_t(size));
+            return nullptr;
+        }
+    }
+
+    auto d = new ImageSharedCachePrivate;
+    d->name = name;
+    d->base = static_cast<uchar*>(base);
+    d->header = header;
+    d->slots = reinterpret_cast<Slot*>(d->base + sizeof(SegmentHeader));
+    d->data = d->base + header->dataOffset;
+    if (!d->registerProcess()) {
+        qCWarning(lcSharedCache) << "shared cache" << name << "is used by too many processes";
+        ::munmap(base, size_t(size));
+        delete d;
+        return nullptr;
+    }
+    return d;
+}
+
+// Take an entry in the header, reusing those of processes that exited. An entry with the
+// pid of this process was left by an earlier process with the same pid.
+bool ImageSharedCachePrivate::registerProcess()
+{
+    if (!lock())
+        return false;
+    reclaimProcesses();
+
+    processIndex = -1;
+    for (int i = 0; i < maxProcesses; i++) {
+        qint32 pid = header->processes[i].pid.load(std::memory_order_acquire);
+        if (pid == ::getpid())
+            releaseProcess(i);
+        if (processIndex < 0 && (!pid || pid == ::getpid()))
+            processIndex = i;
+    }
+    if (processIndex >= 0) {
+        processBit = quint64(1) << processIndex;
+        header->processes[processIndex].pid.store(::getpid(), std::memory_order_release);
+    }
+    unlock();
+    return processIndex >= 0;
+}
+
+void ImageSharedCachePrivate::keyHash(const QString &key, quint8 *out)
+{
+    QByteArray hash = QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1);
+    memcpy(out, hash.constData(), sizeof(Slot::key));
+}
+
+// Find the slot for key and take a reference to it, without locking the segment
+ImageSharedCachePrivate::Slot *ImageSharedCachePrivate::acquire(const quint8 *key)
+{
+    quint64 hash;
+    memcpy(&hash, key, sizeof(hash));
+
+    for (int i = 0; i < probeLength; i++) {
+        Slot *slot = &slots[(hash + quint64(i)) % header->slotCount];
+        if (slot->state.load(std::memory_order_acquire) != SlotReady || memcmp(slot->key, key, sizeof(slot->key)) != 0)
+            continue;
+
+        QMutexLocker l(&refMutex);
+        auto it = refs.find(slot);
+        if (it != refs.end()) {
+            // Already held by this process, so it can't have been evicted since the check
+            ++*it;
+        } else {
+            // Once held, the slot can't be evicted; check that it wasn't before that
+            quint64 holders = slot->holders.fetch_or(processBit, std::memory_order_acq_rel);
+            if ((holders & evictingFlag) || slot->state.load(std::memory_order_acquire) != SlotReady ||
+                memcmp(slot->key, key, sizeof(slot->key)) != 0)
+            {
+                slot->holders.fetch_and(~processBit, std::memory_order_release);
+                continue;
+            }
+            refs.insert(slot, 1);
+        }
+        l.unlock();
+
+        slot->lastUsed.store(header->clock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return slot;
+    }
+    return nullptr;
+}
+
+void ImageSharedCachePrivate::release(Slot *slot)
+{
+    QMutexLocker l(&refMutex);
+    auto it = refs.find(slot);
+    Q_ASSERT(it != refs.end());
+    if (it == refs.end() || --*it > 0)
+        return;
+    refs.erase(it);
+    slot->holders.fetch_and(~processBit, std::memory_order_release);
+}
+
+void ImageSharedCachePrivate::releaseImage(void *info)
+{
+    auto ref = static_cast<ImageReference*>(info);
+    ref->d->release(ref->slot);
+    delete ref;
+}
+
+bool ImageSharedCachePrivate::lock()
+{
+    int r = pthread_mutex_lock(&header->mutex);
+    if (r == EOWNERDEAD) {
+        // Slots the dead process was writing are recovered by isAbandoned
+        qCDebug(lcSharedCache) << "recovered mutex from a process that exited";
+        pthread_mutex_consistent(&header->mutex);
+        return true;
+    }
+    return r == 0;
+}
+
+void ImageSharedCachePrivate::unlock()
+{
+    pthread_mutex_unlock(&header->mutex);
+}
+
+// Must hold the mutex. References held by processes that crashed or exited without
+// releasing them are dropped, so that their slots can be evicted.
+void ImageSharedCachePrivate::reclaimProcesses()
+{
+    for (int i = 0; i < maxProcesses; i++) {
+        qint32 pid = header->processes[i].pid.load(std::memory_order_acquire);
+        if (!pid || pid == ::getpid() || ::kill(pid, 0) == 0 || errno != ESRCH)
+            continue;
+        qCDebug(lcSharedCache) << "releasing references of process" << pid << "that exited";
+        releaseProcess(i);
+    }
+}
+
+// Must hold the mutex
+void ImageSharedCachePrivate::releaseProcess(int index)
+{
+    quint64 bit = quint64(1) << index;
+    for (quint32 i = 0; i < header->slotCount; i++)
+        slots[i].holders.fetch_and(~bit, std::memory_order_release);
+    header->processes[index].pid.store(0, std::memory_order_release);
+}
+
+// Must hold the mutex. Fails if the slot is referenced by any process.
+bool ImageSharedCachePrivate::evict(Slot *slot)
+{
+    quint64 expected = 0;
+    if (!slot->holders.compare_exchange_strong(expected, evictingFlag, std::memory_order_acq_rel))
+        return false;
+    slot->state.store(SlotEmpty, std::memory_order_release);
+    // Readers that saw the flag still remove their own bits
+    slot->holders.fetch_and(~evictingFlag, std::memory_order_release);
+    return true;
+}
+
+// Must hold the mutex. True for slots left in writing state by a process that exited.
+bool ImageSharedCachePrivate::isAbandoned(Slot *slot)
+{
+    if (slot->state.load(std::memory_order_acquire) != SlotWriting || slot->writer == ::getpid())
+        return false;
+    return ::kill(slot->writer, 0) != 0 && errno == ESRCH;
+}
+
+// Must hold the mutex. True for slots that can be evicted when nothing references them.
+bool ImageSharedCachePrivate::isEvictable(Slot *slot)
+{
+    quint32 state = slot->state.load(std::memory_order_acquire);
+    return state == SlotReady || state == SlotStale || isAbandoned(slot);
+}
+
+// Must hold the mutex. Returns an empty slot for key, evicting the least recently used
+// slot it could use if necessary, or nullptr if no slot is free. If key is already present
+// with an image at least as large as size, it's kept and nullptr is returned. A smaller one
+// is replaced: its slot is reused if nothing references it, and otherwise it becomes stale
+// and is evicted once released.
+ImageSharedCachePrivate::Slot *ImageSharedCachePrivate::allocateSlot(const quint8 *key, const QSize &size)
+{
+    quint64 hash;
+    memcpy(&hash, key, sizeof(hash));
+
+    Slot *existing = nullptr;
+    Slot *empty = nullptr;
+    Slot *victim = nullptr;
+    for (int i = 0; i < probeLength; i++) {
+        Slot *slot = &slots[(hash + quint64(i)) % header->slotCount];
+        quint32 state = slot->state.load(std::memory_order_acquire);
+        if ((state == SlotReady || (state == SlotWriting && !isAbandoned(slot))) &&
+            memcmp(slot->key, key, sizeof(slot->key)) == 0)
+        {
+            if (state == SlotWriting || qint64(slot->width) * slot->height >= qint64(size.width()) * size.height())
+                return nullptr;
+            existing = slot;
+            continue;
+        }
+
+        if (state == SlotEmpty) {
+            if (!empty)
+                empty = slot;
+        } else if (isEvictable(slot) && !slot->holders.load(std::memory_order_acquire)) {
+            if (!victim || slot->lastUsed.load(std::memory_order_relaxed) < victim->lastUsed.load(std::memory_order_relaxed))
+                victim = slot;
+        }
+    }
+
+    if (existing && evict(existing))
+        return existing;
+
+    Slot *slot = nullptr;
+    if (empty)
+        slot = empty;
+    else if (victim && evict(victim))
+        slot = victim;
+    if (slot && existing)
+        existing->state.store(SlotStale, std::memory_order_release);
+    return slot;
+}
+
+// Must hold the mutex. Space is allocated in a ring through the data area, evicting the
+// entries that were allocated longest ago. Entries in use are skipped over, trying a few
+// positions at most, because every attached process waits for the mutex meanwhile.
+bool ImageSharedCachePrivate::allocateData(quint64 length, quint64 &offset)
+{
+    length = (length + dataAlignment - 1) & ~(dataAlignment - 1);
+    if (length > header->dataSize / 4)
+        return false;
+
+    quint64 head = header->head;
+    for (int attempt = 0; attempt < allocateAttempts; attempt++) {
+        if (head + length > header->dataSize)
+            head = 0;
+        quint64 end = head + length;
+
+        // Find everything in the way before evicting anything, and skip past all of the
+        // entries in use at once
+        quint64 blockedEnd = 0;
+        for (quint32 i = 0; i < header->slotCount; i++) {
+            Slot *slot = &slots[i];
+            if (slot->state.load(std::memory_order_acquire) == SlotEmpty || slot->offset >= end ||
+                slot->offset + slot->length <= head)
+            {
+                continue;
+            }
+            if (!isEvictable(slot) || slot->holders.load(std::memory_order_acquire))
+                blockedEnd = qMax(blockedEnd, slot->offset + slot->length);
+        }
+
+        if (!blockedEnd) {
+            for (quint32 i = 0; i < header->slotCount; i++) {
+                Slot *slot = &slots[i];
+                if (slot->state.load(std::memory_order_acquire) == SlotEmpty || slot->offset >= end ||
+                    slot->offset + slot->length <= head)
+                {
+                    continue;
+                }
+                // Referenced since the first pass
+                if (!evict(slot))
+                    blockedEnd = qMax(blockedEnd, slot->offset + slot->length);
+            }
+        }
+
+        if (!blockedEnd) {
+            header->head = end;
+            offset = head;
+            return true;
+        }
+        head = blockedEnd;
+    }
+    return false;
+}
+
+bool ImageSharedCache::lookup(const QString &path, const QSize &drawSize, QImage &image, QSize &imageSize)
+{
+    QString key = ImageDiskCache::cacheKey(path, drawSize);
+    if (key.isEmpty())
+        return false;
+
+    quint8 hash[sizeof(ImageSharedCachePrivate::Slot::key)];
+    ImageSharedCachePrivate::keyHash(key, hash);
+    auto slot = d->acquire(hash);
+    if (!slot)
+        return false;
+
+    // The entry must be large enough for the requested draw size, unless it's the full image
+    QSize size(slot->width, slot->height);
+    QSize fullSize(slot->imageWidth, slot->imageHeight);
+    bool valid = slot->format > QImage::Format_Invalid && slot->format < QImage::NImageFormats;
+    if (valid && !drawSize.isEmpty() && size != fullSize) {
+        QSize needed = fullSize.scaled(drawSize, Qt::KeepAspectRatio);
+        valid = size.width() >= needed.width() - 1 && size.height() >= needed.height() - 1;
+    }
+    if (!valid) {
+        qCDebug(lcSharedCache) << "entry for" << path << "at" << size << "is not usable for" << drawSize;
+        d->release(slot);
+        return false;
+    }
+
+    const uchar *bits = d->data + slot->offset;
+    image = QImage(bits, slot->width, slot->height, slot->bytesPerLine, QImage::Format(slot->format),
+                   ImageSharedCachePrivate::releaseImage, new ImageSharedCachePrivate::ImageReference{d.get(), slot});
+    imageSize = fullSize;
+    qCDebug(lcSharedCache) << "loaded" << path << "at" << size;
+    return true;
+}
+
+void ImageSharedCache::insert(const QString &path, const QSize &drawSize, const QImage &image, const QSize &imageSize)
+{
+    QString key = ImageDiskCache::cacheKey(path, drawSize);
+    if (key.isEmpty() || image.isNull())
+        return;
+
+    using Slot = ImageSharedCachePrivate::Slot;
+    quint8 hash[sizeof(Slot::key)];
+    ImageSharedCachePrivate::keyHash(key, hash);
+    quint64 length = quint64(image.bytesPerLine()) * quint64(image.height());
+
+    if (!d->lock())
+        return;
+    d->reclaimProcesses();
+    quint64 offset = 0;
+    Slot *slot = d->allocateSlot(hash, image.size());
+    if (!slot || !d->allocateData(length, offset)) {
+        d->unlock();
+        qCDebug(lcSharedCache) << "no space for" << path << "at" << image.size();
+        return;
+    }
+
+    slot->writer = ::getpid();
+    memcpy(slot->key, hash, sizeof(slot->key));
+    slot->width = image.width();
+    slot->height = image.height();
+    slot->bytesPerLine = image.bytesPerLine();
+    slot->format = image.format();
+    slot->imageWidth = imageSize.width();
+    slot->imageHeight = imageSize.height();
+    slot->offset = offset;
+    slot->length = length;
+    slot->state.store(ImageSharedCachePrivate::SlotWriting, std::memory_order_release);
+    d->unlock();
+
+    // The data is reserved by the slot in writing state, and can be copied without the lock
+    memcpy(d->data + offset, image.constBits(), size_t(length));
+    slot->lastUsed.store(d->header->clock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    slot->state.store(ImageSharedCachePrivate::SlotReady, std::memory_order_release);
+    qCDebug(lcSharedCache) << "stored" << path << "at" << image.size();
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <QImage>
+#include <QString>
+#include <memory>
+
+class ImageSharedCachePrivate;
+
+// ImageSharedCache holds downscaled images in a shared memory segment, so that several
+// processes showing the same images only decode them once. Images found in the cache
+// are mapped directly into a read-only QImage, without copying.
+//
+// The cache is enabled by setting SPEEDYIMAGE_SHARED_CACHE_SIZE to the size of the
+// segment in bytes. Processes using the same SPEEDYIMAGE_SHARED_CACHE_NAME (default
+// "speedyimage-<uid>") share a segment, which is created by the first of them and keeps
+// the size it was created with. Space is reused in the order it was allocated, skipping
+// entries that are still used by any process. Entries used by a process that crashed are
+// released once another process notices it's gone. Up to 63 processes share a segment.
+//
+// Entries are keyed like ImageDiskCache. Only available on unix platforms.
+//
+// All functions are thread-safe.
+class ImageSharedCache
+{
+public:
+    // Returns the process-wide shared cache, or nullptr if it is disabled
+    static ImageSharedCache *instance();
+
+    ~ImageSharedCache();
+
+    // Find an image for path large enough to draw at drawSize. The returned image keeps
+    // the entry from being evicted by any process until it is released.
+    bool lookup(const QString &path, const QSize &drawSize, QImage &image, QSize &imageSize);
+    void insert(const QString &path, const QSize &drawSize, const QImage &image, const QSize &imageSize);
+
+    QString name() const;
+    qint64 size() const;
+
+private:
+    std::unique_ptr<ImageSharedCachePrivate> d;
+
+    ImageSharedCache(ImageSharedCachePrivate *dp);
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "imagesharedcache.h"
+#include <QHash>
+#include <QMutex>
+#include <atomic>
+#include <pthread.h>
+
+// Layout of the shared segment: SegmentHeader, followed by slotCount Slots, followed by
+// the pixel data at dataOffset.
+//
+// Each process using the segment has an entry in the header, and a bit in the holders of
+// every slot it references; references within the process are counted locally. Readers find
+// entries without locking. A reader sets its bit in holders and then checks that the slot
+// still holds its key; a slot can only be reused by a writer that changes holders from
+// exactly zero to evictingFlag. Writers allocate space and slots under the robust
+// process-shared mutex in the header, and clear the bits of processes that exited.
+class ImageSharedCachePrivate
+{
+public:
+    enum SlotState : quint32 {
+        SlotEmpty,
+        SlotWriting,
+        SlotReady,
+        // Replaced by a larger image for the same key while it was still referenced. Not
+        // found by lookups, and evicted like a ready slot once it's released.
+        SlotStale
+    };
+
+    struct Slot
+    {
+        std::atomic<quint32> state;
+        std::atomic<quint64> holders;
+        std::atomic<quint64> lastUsed;
+        // Process writing the slot, to recover slots of a writer that crashed
+        qint32 writer;
+        quint8 key[20];
+        qint32 width;
+        qint32 height;
+        qint32 bytesPerLine;
+        qint32 format;
+        qint32 imageWidth;
+        qint32 imageHeight;
+        // Pixel data relative to dataOffset
+        quint64 offset;
+        quint64 length;
+    };
+
+    struct ProcessEntry
+    {
+        // Zero when unused
+        std::atomic<qint32> pid;
+    };
+
+    static const int maxProcesses = 63;
+
+    struct SegmentHeader
+    {
+        quint32 magic;
+        quint32 version;
+        std::atomic<quint32> initialized;
+        quint32 slotCount;
+        quint64 size;
+        quint64 dataOffset;
+        quint64 dataSize;
+        std::atomic<quint64> clock;
+
+        // Protects allocation and writing of slots
+        pthread_mutex_t mutex;
+        // Next allocation in the data area, wrapping to the start
+        quint64 head;
+        // Processes using the segment, protected by the mutex
+        ProcessEntry processes[maxProcesses];
+    };
+
+    static const quint32 segmentMagic = 0x53495343; // SISC
+    static const quint32 segmentVersion = 3;
+    static const quint64 evictingFlag = quint64(1) << 63;
+    // Slots searched for a key, starting at the slot for its hash
+    static const int probeLength = 16;
+    // Positions in the data area tried for an allocation, each a scan of all slots
+    static const int allocateAttempts = 4;
+    static const quint64 dataAlignment = 64;
+
+    QString name;
+    uchar *base;
+    SegmentHeader *header;
+    Slot *slots;
+    uchar *data;
+
+    // Entry of this process in the header, and its bit in holders
+    int processIndex;
+    quint64 processBit;
+    // References this process holds to each slot
+    QMutex refMutex;
+    QHash<Slot*,int> refs;
+
+    // Info for the cleanup of images referencing a slot
+    struct ImageReference
+    {
+        ImageSharedCachePrivate *d;
+        Slot *slot;
+    };
+
+    static ImageSharedCachePrivate *attach(const QString &name, qint64 size);
+    bool registerProcess();
+
+    static void keyHash(const QString &key, quint8 *out);
+    Slot *acquire(const quint8 *key);
+    void release(Slot *slot);
+    static void releaseImage(void *info);
+
+    bool lock();
+    void unlock();
+    void reclaimProcesses();
+    void releaseProcess(int index);
+    bool evict(Slot *slot);
+    bool isAbandoned(Slot *slot);
+    bool isEvictable(Slot *slot);
+    Slot *allocateSlot(const quint8 *key, const QSize &size);
+    bool allocateData(quint64 length, quint64 &offset);
+};
@@ -1,6 +1,10 @@
 #include "imagetexturecache_p.h"
+#include <QElapsedTimer>
 #include <QLoggingCategory>
+#include <QRunnable>
 #include <QSGTexture>
+#include <QThread>
+#include <QtMath>
 
 Q_LOGGING_CATEGORY(lcCache, "speedyimage.cache")
 
@@ -25,14 +29,29 @@ ImageTextureCache::ImageTextureCache(QQuickWindow *window)
 
 ImageTextureCachePrivate::ImageTextureCachePrivate(QQuickWindow *window)
     : window(window)
-    , freeThrottle(0)
-    , softLimit(qgetenv("SPEEDYIMAGE_CACHE_SIZE").toInt())
+    , windowGuard(window)
+    , freeHead(nullptr)
+    , freeTail(nullptr)
+    , freeCount(0)
+    , budget(CacheBudget::instance())
+    , imageCache(DecodedImageCache::instance())
+    , updateRequested(false)
+    , releaser(std::make_shared<ImageTextureReleaser>())
+    , uploadBytesPerFrame(qgetenv("SPEEDYIMAGE_UPLOAD_BYTES").toLongLong())
+    , uploadTimePerFrame(qgetenv("SPEEDYIMAGE_UPLOAD_TIME").toInt())
 {
-    if (softLimit < 1) {
-        softLimit = 128 * 1048576;
+    if (uploadBytesPerFrame < 1) {
+        uploadBytesPerFrame = 8 * 1048576;
+    }
+    if (uploadTimePerFrame < 1) {
+        uploadTimePerFrame = 4;
     }
 
+    connect(window, &QQuickWindow::beforeSynchronizing, this, &ImageTextureCachePrivate::renderThreadUpload, Qt::DirectConnection);
     connect(window, &QQuickWindow::beforeSynchronizing, this, &ImageTextureCachePrivate::renderThreadFree, Qt::DirectConnection);
+    connect(window, &QQuickWindow::sceneGraphAboutToStop, this, &ImageTextureCachePrivate::renderThreadStop, Qt::DirectConnection);
+    // Evict on the next frame when the budget shrinks
+    connect(budget, &CacheBudget::budgetChanged, this, [this]() { requestUpdate(); });
 }
 
 ImageTextureCache::~ImageTextureCache()
@@ -40,112 +59,452 @@ ImageTextureCache::~ImageTextureCache()
     ImageTextureCachePrivate::instances.remove(d->window);
 }
 
+namespace {
+
+class DeleteTexturesJob : public QRunnable
+{
+public:
+    DeleteTexturesJob(const QVector<QSGTexture*> &textures)
+        : textures(textures)
+    {
+    }
+
+    void run() override
+    {
+        qDeleteAll(textures);
+    }
+
+private:
+    QVector<QSGTexture*> textures;
+};
+
+}
+
+// Textures still used by nodes are released with the nodes, on the render thread. The rest
+// are deleted by a job on the render thread. Once the window is gone, its scene graph has
+// stopped and renderThreadStop already deleted them.
 ImageTextureCachePrivate::~ImageTextureCachePrivate()
 {
+    QMutexLocker l(&uploadMutex);
+    pendingUploads.clear();
+    for (auto it = cache.constBegin(); it != cache.constEnd(); it++)
+        (*it)->texture.reset();
+    l.unlock();
+
+    QMutexLocker releaseLock(&releaser->mutex);
+    QVector<QSGTexture*> textures;
+    textures.swap(releaser->released);
+    releaseLock.unlock();
+
+    if (!textures.isEmpty() && windowGuard)
+        windowGuard->scheduleRenderJob(new DeleteTexturesJob(textures), QQuickWindow::NoStage);
+}
+
+std::shared_ptr<QSGTexture> ImageTextureReleaser::manage(const std::shared_ptr<ImageTextureReleaser> &self, QSGTexture *texture)
+{
+    return std::shared_ptr<QSGTexture>(texture, [self](QSGTexture *t) { self->release(t); });
+}
+
+void ImageTextureReleaser::release(QSGTexture *texture)
+{
+    QMutexLocker l(&mutex);
+    if (QThread::currentThread() != renderThread) {
+        released.append(texture);
+        return;
+    }
+    l.unlock();
+    delete texture;
+}
+
+void ImageTextureReleaser::deleteReleased()
+{
+    QMutexLocker l(&mutex);
+    renderThread = QThread::currentThread();
+    QVector<QSGTexture*> textures;
+    textures.swap(released);
+    l.unlock();
+    qDeleteAll(textures);
+}
+
+// Levels are half powers of two, so an entry holds at most twice the pixels that are drawn
+static int levelSide(int level)
+{
+    int side = 1 << (level / 2);
+    if (level % 2)
+        side = qRound(side * M_SQRT2);
+    return side;
+}
+
+int ImageTextureCache::levelForSize(const QSize &drawSize)
+{
+    int side = qMax(drawSize.width(), drawSize.height());
+    if (side <= 0 || side > levelSide(fullSizeLevel - 1))
+        return fullSizeLevel;
+
+    int level = 0;
+    while (levelSide(level) < side)
+        level++;
+    return level;
+}
+
+QSize ImageTextureCache::levelDrawSize(const QSize &loadingSize, int level)
+{
+    if (level >= fullSizeLevel)
+        return QSize(0, 0);
+    int side = levelSide(level);
+    return QSize(loadingSize.width() > 0 ? side : 0, loadingSize.height() > 0 ? side : 0);
 }
 
-ImageTextureCacheEntry ImageTextureCache::get(const QString &key)
+bool ImageTextureCache::insertDecoded(const QString &source, int level, const QImage &image, const QSize &imageSize)
 {
+    DecodedImageCache *imageCache = DecodedImageCache::instance();
+    if (!imageCache->isEnabled())
+        return false;
+    imageCache->insert(ImageTextureCachePrivate::cacheKey(source, level), image, imageSize);
+    return true;
+}
+
+QString ImageTextureCachePrivate::cacheKey(const QString &source, int level)
+{
+    return QString::number(level) + QLatin1Char(':') + source;
+}
+
+ImageTextureCacheEntry ImageTextureCache::get(const QString &source, int level)
+{
+    QString key = ImageTextureCachePrivate::cacheKey(source, level);
     QMutexLocker l(&d->mutex);
     auto data = d->cache.value(key);
-    if (!data) {
-        data = std::make_shared<ImageTextureCacheData>(d.get(), key);
-        d->cache.insert(key, data);
-        data->updateCost();
+    if (data)
+        return ImageTextureCacheEntry(data);
+
+    data = std::make_shared<ImageTextureCacheData>(d.get(), source, level);
+    d->cache.insert(key, data);
+    d->levels[source] |= 1u << level;
+    data->updateCost();
+    ImageTextureCacheEntry entry(data);
+    l.unlock();
+
+    // Upload again from decoded images if possible
+    QImage image;
+    QSize imageSize;
+    if (d->imageCache->lookup(key, image, imageSize)) {
+        qCDebug(lcCache) << "uploading" << key << "from decoded image cache";
+        data->imageSize = imageSize;
+        d->queueUpload(data, image);
     }
-    return ImageTextureCacheEntry(data);
+    return entry;
 }
 
-void ImageTextureCache::insert(const QString &key, const QImage &image, const QSize &imageSize)
+ImageTextureCacheEntry ImageTextureCache::getBest(const QString &source, int level)
 {
-    auto entry = get(key);
-    entry.d->image = image;
+    QMutexLocker l(&d->mutex);
+    quint32 mask = d->levels.value(source);
+    if (!mask)
+        return ImageTextureCacheEntry();
+
+    auto loaded = [&](int lv) -> std::shared_ptr<ImageTextureCacheData> {
+        if (!(mask & (1u << lv)))
+            return nullptr;
+        auto data = d->cache.value(ImageTextureCachePrivate::cacheKey(source, lv));
+        if (!data || !data->texture)
+            return nullptr;
+        return data;
+    };
+
+    // The closest larger level draws well when scaled down; a smaller one is a placeholder
+    for (int lv = level; lv <= fullSizeLevel; lv++) {
+        if (auto data = loaded(lv))
+            return ImageTextureCacheEntry(data);
+    }
+    for (int lv = level - 1; lv >= 0; lv--) {
+        if (auto data = loaded(lv))
+            return ImageTextureCacheEntry(data);
+    }
+    return ImageTextureCacheEntry();
+}
+
+// Textures are created on the render thread, where they can use the atlas, under a budget
+// for each frame. Observers are notified once the texture is ready.
+void ImageTextureCache::insert(const QString &source, int level, const QImage &image, const QSize &imageSize)
+{
+    auto entry = get(source, level);
+    d->imageCache->insert(entry.d->key, image, imageSize);
     entry.d->imageSize = imageSize;
     entry.d->error = QString();
-    // XXX smarter texture management
-    // XXX Atlas won't be used because this isn't done from render thread
-    // XXX overwrite of texture will leak
-    entry.d->texture = d->window->createTextureFromImage(image, {QQuickWindow::TextureCanUseAtlas, QQuickWindow::TextureIsOpaque});
-    Q_ASSERT(entry.d->texture);
-    entry.d->updateCost();
+    d->queueUpload(entry.d, image);
+}
 
-    emit changed(key);
+void ImageTextureCachePrivate::queueUpload(const std::shared_ptr<ImageTextureCacheData> &data, const QImage &image)
+{
+    QMutexLocker l(&uploadMutex);
+    data->image = image;
+    data->loadedSize = image.size();
+    if (!data->uploadPending) {
+        data->uploadPending = true;
+        pendingUploads.append(data);
+    }
+    l.unlock();
+
+    requestUpdate();
 }
 
-void ImageTextureCache::insert(const QString &key, const QString &error)
+void ImageTextureCache::insert(const QString &source, int level, const QString &error)
 {
-    auto entry = get(key);
+    auto entry = get(source, level);
+    d->imageCache->remove(entry.d->key);
+
+    QMutexLocker l(&d->uploadMutex);
     entry.d->image = QImage();
+    entry.d->loadedSize = QSize();
     entry.d->imageSize = QSize();
     entry.d->error = error;
-    // XXX leak if texture exists
-    entry.d->texture = nullptr;
-    entry.d->updateCost();
+    entry.d->uploadPending = false;
+    d->pendingUploads.removeOne(entry.d);
+    if (entry.d->texture) {
+        entry.d->texture.reset();
+        entry.d->updateCost();
+    }
+    l.unlock();
+
+    d->requestUpdate();
+    d->notifyChanged(source, level);
+}
+
+void ImageTextureCache::addObserver(const QString &source, ImageTextureCacheObserver *observer)
+{
+    auto &list = d->observers[source];
+    if (!list.contains(observer))
+        list.append(observer);
+}
 
-    emit changed(key);
+void ImageTextureCache::removeObserver(const QString &source, ImageTextureCacheObserver *observer)
+{
+    auto it = d->observers.find(source);
+    if (it == d->observers.end())
+        return;
+    it->removeOne(observer);
+    if (it->isEmpty())
+        d->observers.erase(it);
 }
 
-void ImageTextureCachePrivate::setFreeable(const std::shared_ptr<ImageTextureCacheData> &data, bool set)
+// Queue a change for observers, from any thread. Delivery is scheduled once for all
+// changes queued until it runs.
+void ImageTextureCachePrivate::notifyChanged(const QString &source, int level)
+{
+    QMutexLocker l(&changeMutex);
+    bool schedule = changes.isEmpty();
+    changes.insert(qMakePair(source, level));
+    l.unlock();
+
+    if (schedule)
+        QMetaObject::invokeMethod(this, "deliverChanges", Qt::QueuedConnection);
+}
+
+void ImageTextureCachePrivate::deliverChanges()
+{
+    QMutexLocker l(&changeMutex);
+    auto batch = changes;
+    changes.clear();
+    l.unlock();
+
+    for (const auto &change : batch) {
+        // Observers may be removed by the notification of another
+        const auto list = observers.value(change.first);
+        for (ImageTextureCacheObserver *observer : list) {
+            auto it = observers.constFind(change.first);
+            if (it != observers.constEnd() && it->contains(observer))
+                observer->cacheEntryChanged(change.first, change.second);
+        }
+    }
+}
+
+// Schedule a frame on the window, from any thread
+void ImageTextureCachePrivate::requestUpdate()
+{
+    QMutexLocker l(&uploadMutex);
+    if (updateRequested)
+        return;
+    updateRequested = true;
+    l.unlock();
+
+    QMetaObject::invokeMethod(window, "update", Qt::QueuedConnection);
+}
+
+// Textures that were replaced are still used by nodes until the items showing them have
+// synchronized, which may be many frames later for items that aren't updated. Nodes hold a
+// reference to their texture, and it's deleted once the last is released.
+void ImageTextureCachePrivate::renderThreadUpload()
+{
+    releaser->deleteReleased();
+
+    QMutexLocker l(&uploadMutex);
+    updateRequested = false;
+
+    // At least one texture is created in every frame, even if it exceeds the budget
+    QElapsedTimer timer;
+    timer.start();
+    qint64 bytes = 0;
+    QVector<std::shared_ptr<ImageTextureCacheData>> uploaded;
+
+    while (!pendingUploads.isEmpty() && (uploaded.isEmpty() ||
+           (bytes < uploadBytesPerFrame && timer.elapsed() < uploadTimePerFrame)))
+    {
+        auto data = pendingUploads.takeFirst();
+        data->uploadPending = false;
+        QImage image = data->image;
+        data->image = QImage();
+        l.unlock();
+
+        QQuickWindow::CreateTextureOptions options = QQuickWindow::TextureCanUseAtlas;
+        if (!image.hasAlphaChannel())
+            options |= QQuickWindow::TextureIsOpaque;
+        auto texture = releaser->manage(releaser, window->createTextureFromImage(image, options));
+        Q_ASSERT(texture);
+
+        l.relock();
+        data->texture = texture;
+        data->updateCost();
+        bytes += qint64(image.bytesPerLine()) * image.height();
+        uploaded.append(data);
+    }
+
+    bool moreFrames = !pendingUploads.isEmpty();
+    if (!uploaded.isEmpty()) {
+        qCDebug(lcCache) << "uploaded" << uploaded.size() << "textures with" << bytes << "bytes in" << timer.elapsed() << "ms;"
+                         << pendingUploads.size() << "still pending";
+    }
+    l.unlock();
+
+    for (const auto &data : uploaded)
+        notifyChanged(data->source, data->level);
+    if (moreFrames)
+        requestUpdate();
+}
+
+// Textures belong to the scene graph, so they're all released when it stops, as when the
+// window is closed. Those that are still in the decoded image cache are uploaded again if
+// it starts again.
+void ImageTextureCachePrivate::renderThreadStop()
+{
+    releaser->deleteReleased();
+
+    QMutexLocker cacheLock(&mutex);
+    QVector<std::shared_ptr<ImageTextureCacheData>> released;
+    QMutexLocker l(&uploadMutex);
+    for (auto it = cache.constBegin(); it != cache.constEnd(); it++) {
+        if (!(*it)->texture)
+            continue;
+        (*it)->texture.reset();
+        (*it)->updateCost();
+        released.append(*it);
+    }
+    l.unlock();
+    cacheLock.unlock();
+
+    qCDebug(lcCache) << "released" << released.size() << "textures as the scene graph stopped";
+    for (const auto &data : released) {
+        QImage image;
+        QSize imageSize;
+        if (imageCache->lookup(data->key, image, imageSize)) {
+            data->imageSize = imageSize;
+            queueUpload(data, image);
+        } else {
+            notifyChanged(data->source, data->level);
+        }
+    }
+}
+
+// Released entries go to the tail of the free list, and become most recently used
+void ImageTextureCachePrivate::setFreeable(ImageTextureCacheData *data, bool set)
 {
     QMutexLocker l(&freeMutex);
+    if (data->isFreeable)
+        unlinkFreeable(data);
+
     if (set) {
-        freeable.append(data);
-    } else {
-        freeable.removeOne(data);
+        data->freePrev = freeTail;
+        data->freeNext = nullptr;
+        if (freeTail)
+            freeTail->freeNext = data;
+        else
+            freeHead = data;
+        freeTail = data;
+        data->isFreeable = true;
+        freeCount++;
     }
 }
 
-void ImageTextureCachePrivate::renderThreadFree()
+// Must hold freeMutex
+void ImageTextureCachePrivate::unlinkFreeable(ImageTextureCacheData *data)
 {
-    // Only check cache every 100 frames
-    // XXX Would a timer with affinity to the render thread do this without being as reliant on render timing?
-    if (++freeThrottle < 100)
-        return;
-    freeThrottle = 0;
+    Q_ASSERT(data->isFreeable);
+    if (data->freePrev)
+        data->freePrev->freeNext = data->freeNext;
+    else
+        freeHead = data->freeNext;
+    if (data->freeNext)
+        data->freeNext->freePrev = data->freePrev;
+    else
+        freeTail = data->freePrev;
+    data->freePrev = data->freeNext = nullptr;
+    data->isFreeable = false;
+    freeCount--;
+}
 
-    qCDebug(lcCache) << "cache using" << cacheCost << "of" << softLimit;
+// Evict least recently used entries whenever the cache is over budget
+void ImageTextureCachePrivate::renderThreadFree()
+{
+    qint64 softLimit = budget->budget();
     if (cacheCost <= softLimit)
         return;
 
-    // Copy freeable and clear so we can release the mutex while working on cache, to avoid deadlocks
-    QMutexLocker freeLock(&freeMutex);
-    if (freeable.isEmpty())
-        return;
-    auto freeList = freeable;
-    freeable.clear();
-    freeLock.unlock();
-
     // There is no path for a data to go from 0 to 1 ref without holding the cache mutex,
     // so holding it guarantees that data with 0 ref can be freed safely.
     QMutexLocker cacheLock(&mutex);
-    while (!freeList.isEmpty()) {
-        auto data = freeList.takeFirst();
-        if (data->getRefCount() > 0)
-            continue;
+    QMutexLocker freeLock(&freeMutex);
+    if (!freeHead)
+        return;
 
-        qCDebug(lcCache) << "cache freeing" << data->cost << "from" << data->key;
+    qCDebug(lcCache) << "cache using" << cacheCost << "of" << softLimit;
+    int freed = 0;
+    ImageTextureCacheData *next = freeHead;
+    while (next && cacheCost > softLimit) {
+        ImageTextureCacheData *data = next;
+        next = data->freeNext;
+
+        // Referenced again, but the ref has not taken it off the list yet
+        if (data->getRefCount() > 0) {
+            unlinkFreeable(data);
+            continue;
+        }
 
-        delete data->texture;
-        data->texture = nullptr;
+        // Data with an upload pending stays until it has a texture
+        QMutexLocker uploadLock(&uploadMutex);
+        if (data->uploadPending)
+            continue;
+        uploadLock.unlock();
 
-        Q_ASSERT(cache.value(data->key) == data);
-        cache.remove(data->key);
+        qCDebug(lcCache) << "cache freeing" << data->cost << "from" << data->key;
+        unlinkFreeable(data);
 
+        uploadLock.relock();
+        data->texture.reset();
+        uploadLock.unlock();
         cacheCost -= data->cost;
-        if (cacheCost <= softLimit)
-            break;
-    }
+        freed++;
 
-    qCDebug(lcCache) << "cache using" << cacheCost << "of" << softLimit << "after free;" << freeList.size() << "items still freeable";
-    cacheLock.unlock();
+        auto it = levels.find(data->source);
+        if (it != levels.end() && !(*it &= ~(1u << data->level)))
+            levels.erase(it);
 
-    // Move anything we didn't free back into freeable
-    if (!freeList.isEmpty()) {
-        freeLock.relock();
-        freeList += freeable;
-        freeable = freeList;
-        freeLock.unlock();
+        // Removing from cache releases the data
+        QString key = data->key;
+        Q_ASSERT(cache.value(key).get() == data);
+        cache.remove(key);
     }
+
+    qCDebug(lcCache) << "cache using" << cacheCost << "of" << softLimit << "after freeing" << freed << "entries;"
+                     << freeCount << "still freeable";
 }
 
 ImageTextureCacheEntry::ImageTextureCacheEntry()
@@ -191,9 +550,14 @@ void ImageTextureCacheEntry::reset()
     d.reset();
 }
 
-QImage ImageTextureCacheEntry::image() const
+QString ImageTextureCacheEntry::source() const
+{
+    return d ? d->source : QString();
+}
+
+int ImageTextureCacheEntry::level() const
 {
-    return d ? d->image : QImage();
+    return d ? d->level : -1;
 }
 
 QString ImageTextureCacheEntry::error() const
@@ -203,7 +567,7 @@ QString ImageTextureCacheEntry::error() const
 
 QSize ImageTextureCacheEntry::loadedSize() const
 {
-    return d ? d->image.size() : QSize();
+    return d ? d->loadedSize : QSize();
 }
 
 QSize ImageTextureCacheEntry::imageSize() const
@@ -213,19 +577,35 @@ QSize ImageTextureCacheEntry::imageSize() const
 
 QSGTexture *ImageTextureCacheEntry::texture() const
 {
-    return d ? d->texture : nullptr;
+    return d ? d->texture.get() : nullptr;
+}
+
+std::shared_ptr<QSGTexture> ImageTextureCacheEntry::sharedTexture() const
+{
+    if (!d)
+        return nullptr;
+    QMutexLocker l(&d->cache->uploadMutex);
+    return d->texture;
+}
+
+bool ImageTextureCacheEntry::isUploadPending() const
+{
+    if (!d)
+        return false;
+    QMutexLocker l(&d->cache->uploadMutex);
+    return d->uploadPending;
 }
 
 void ImageTextureCacheData::updateCost()
 {
-    int newCost = 1;
+    qint64 newCost = 1;
     if (texture) {
         QSize sz = texture->textureSize();
-        newCost = qMax(sz.width() * sz.height() * 3, 1);
+        newCost = qMax(qint64(sz.width()) * sz.height() * 4, qint64(1));
     }
 
     if (cost != newCost) {
-        int delta = newCost - cost;
+        qint64 delta = newCost - cost;
         cost = newCost;
         cache->cacheCost += delta;
     }
@@ -10,6 +10,15 @@ class ImageTextureCacheData;
 class ImageTextureCacheEntry;
 class ImageTextureCachePrivate;
 
+// ImageTextureCacheObserver is notified when entries for a source change, see
+// ImageTextureCache::addObserver.
+class ImageTextureCacheObserver
+{
+public:
+    virtual ~ImageTextureCacheObserver() {}
+    virtual void cacheEntryChanged(const QString &source, int level) = 0;
+};
+
 // ImageTextureCacheEntry represents an entry in the image texture cache,
 // holds a reference to that entry to ensure its lifetime.
 class ImageTextureCacheEntry
@@ -24,14 +33,23 @@ public:
     ImageTextureCacheEntry &operator=(const ImageTextureCacheEntry &o);
 
     bool isNull() const { return !d; }
-    bool isEmpty() const { return image().isNull() && !texture() && error().isEmpty(); }
+    bool operator==(const ImageTextureCacheEntry &o) const { return d == o.d; }
+    bool operator!=(const ImageTextureCacheEntry &o) const { return d != o.d; }
+    // Empty entries have nothing to show yet. Entries with an image waiting for upload are
+    // still empty, and will signal changed once the texture is ready.
+    bool isEmpty() const { return !texture() && error().isEmpty(); }
+    bool isUploadPending() const;
     void reset();
 
-    QImage image() const;
+    QString source() const;
+    int level() const;
     QString error() const;
     QSize loadedSize() const;
     QSize imageSize() const;
     QSGTexture *texture() const;
+    // A reference that keeps the texture alive after the entry replaces or evicts it, for
+    // the node drawing it. Release it on the render thread.
+    std::shared_ptr<QSGTexture> sharedTexture() const;
 
 private:
     std::shared_ptr<ImageTextureCacheData> d;
@@ -39,26 +57,63 @@ private:
     ImageTextureCacheEntry(const std::shared_ptr<ImageTextureCacheData> &dp);
 };
 
+// ImageTextureCache holds the textures of loaded images for a window. Each source may
+// have entries at several size levels, so that small and large items showing the same
+// image don't replace each other's textures. Textures of
+// unreferenced entries are evicted in least recently used order when they use more
+// than SPEEDYIMAGE_CACHE_SIZE bytes (default 128MB).
+//
+// Decoded images are also kept in the process-wide DecodedImageCache, so that an evicted
+// texture or the same image in another window only needs an upload. Entries don't keep
+// their image once it is uploaded.
 class ImageTextureCache : public QObject
 {
     Q_OBJECT
 
 public:
+    // Level of entries holding the full size image
+    static const int fullSizeLevel = 31;
+
     static std::shared_ptr<ImageTextureCache> forWindow(QQuickWindow *window);
     virtual ~ImageTextureCache();
 
-    // Query the cache with the given key, and return a CacheEntry with the
+    // An entry at level holds an image fitting within 2^(level/2) pixels on its larger side,
+    // rounded, or the full image for fullSizeLevel. Draw sizes with both dimensions zero, or
+    // larger than the last level, are full size.
+    static int levelForSize(const QSize &drawSize);
+    // Draw size to load for an entry at level, which covers any loadingSize at that level
+    static QSize levelDrawSize(const QSize &loadingSize, int level);
+
+    // Keep a decoded image for source at level in the DecodedImageCache, so that an entry
+    // requested later in any window only needs an upload. This is for images loaded without
+    // an item, like prefetches. May be called from any thread. Returns false if the decoded
+    // image cache is disabled.
+    static bool insertDecoded(const QString &source, int level, const QImage &image, const QSize &imageSize);
+
+    // Query the cache with the given source and level, and return a CacheEntry with the
     // result and a strong reference to this entry in the cache.
     //
-    // Even if the key does not exist or has no result, an entry will be added
-    // to the cache. If the key is later inserted, the entry will be updated.
-    ImageTextureCacheEntry get(const QString &key);
+    // Even if the entry does not exist or has no result, an entry will be added
+    // to the cache. If the entry is later inserted, it will be updated.
+    ImageTextureCacheEntry get(const QString &source, int level);
 
-    void insert(const QString &key, const QImage &image, const QSize &imageSize);
-    void insert(const QString &key, const QString &error);
+    // Return the entry with a texture for source closest to level, preferring larger
+    // levels, or a null entry if there is none. Does not add any entry to the cache.
+    ImageTextureCacheEntry getBest(const QString &source, int level);
 
-signals:
-    void changed(const QString &key);
+    // Insert may be called from any thread. Textures are created on the render thread
+    // during the following frames, and observers are notified when the texture is ready.
+    //
+    // The number of bytes uploaded per frame is limited by SPEEDYIMAGE_UPLOAD_BYTES
+    // (default 8MB) and the time spent by SPEEDYIMAGE_UPLOAD_TIME (default 4ms).
+    void insert(const QString &source, int level, const QImage &image, const QSize &imageSize);
+    void insert(const QString &source, int level, const QString &error);
+
+    // Observers are notified on the GUI thread when an entry for source changes. Changes
+    // are coalesced and delivered in one batch, and only to the observers of that source.
+    // Only valid on GUI thread.
+    void addObserver(const QString &source, ImageTextureCacheObserver *observer);
+    void removeObserver(const QString &source, ImageTextureCacheObserver *observer);
 
 private:
     std::shared_ptr<ImageTextureCachePrivate> d;
@@ -1,9 +1,31 @@
 #pragma once
 
 #include "imagetexturecache.h"
+#include "decodedimagecache.h"
+#include "cachebudget.h"
 #include <QAtomicInteger>
 #include <QImage>
 #include <QMutex>
+#include <QPointer>
+#include <QSet>
+
+class QThread;
+
+// Textures are shared with the nodes drawing them, so that a texture that was replaced or
+// evicted stays alive until no node uses it. The last reference may be dropped on any
+// thread, but textures are only deleted on the render thread; those released elsewhere
+// wait for the next frame. Shared with the textures, which can outlive the cache.
+struct ImageTextureReleaser
+{
+    QMutex mutex;
+    QThread *renderThread = nullptr;
+    QVector<QSGTexture*> released;
+
+    std::shared_ptr<QSGTexture> manage(const std::shared_ptr<ImageTextureReleaser> &self, QSGTexture *texture);
+    void release(QSGTexture *texture);
+    // Render thread only
+    void deleteReleased();
+};
 
 class ImageTextureCachePrivate : public QObject
 {
@@ -12,59 +34,113 @@ class ImageTextureCachePrivate : public QObject
 public:
     static QHash<QQuickWindow*,std::weak_ptr<ImageTextureCache>> instances;
     QQuickWindow *window;
+    // Cleared once the window is destroyed, when the cache may still be alive
+    QPointer<QQuickWindow> windowGuard;
 
     QMutex mutex;
     QHash<QString,std::shared_ptr<ImageTextureCacheData>> cache;
-    QAtomicInt cacheCost;
+    // Bitmask of the levels in cache for each source
+    QHash<QString,quint32> levels;
+    // Bytes used by textures in cache
+    QAtomicInteger<qint64> cacheCost;
 
+    // Unreferenced entries in order of release, least recently used first. This is an
+    // intrusive list through the data, which stays alive because it's still in cache.
     QMutex freeMutex;
-    QVector<std::shared_ptr<ImageTextureCacheData>> freeable;
-    int freeThrottle;
+    ImageTextureCacheData *freeHead;
+    ImageTextureCacheData *freeTail;
+    int freeCount;
+
+    // Budget for the bytes of textures kept in cache, including those of unreferenced entries
+    CacheBudget * const budget;
 
-    int softLimit;
+    // Decoded images shared by all windows, which can be uploaded again after their
+    // texture was evicted
+    DecodedImageCache * const imageCache;
+
+    // Images waiting to be uploaded on the render thread. Protected by uploadMutex, as are
+    // the texture of every data and the image of any data with uploadPending set.
+    QMutex uploadMutex;
+    QVector<std::shared_ptr<ImageTextureCacheData>> pendingUploads;
+    bool updateRequested;
+    const std::shared_ptr<ImageTextureReleaser> releaser;
+
+    qint64 uploadBytesPerFrame;
+    int uploadTimePerFrame;
+
+    // Observers by source, only used on the GUI thread
+    QHash<QString,QVector<ImageTextureCacheObserver*>> observers;
+
+    // Changes waiting for delivery to observers, protected by changeMutex
+    QMutex changeMutex;
+    QSet<QPair<QString,int>> changes;
 
     ImageTextureCachePrivate(QQuickWindow *window);
     ~ImageTextureCachePrivate();
 
-    void setFreeable(const std::shared_ptr<ImageTextureCacheData> &data, bool freeable);
+    static QString cacheKey(const QString &source, int level);
+
+    void queueUpload(const std::shared_ptr<ImageTextureCacheData> &data, const QImage &image);
+    void setFreeable(ImageTextureCacheData *data, bool freeable);
+    void unlinkFreeable(ImageTextureCacheData *data);
+    void requestUpdate();
+    void notifyChanged(const QString &source, int level);
 
 public slots:
+    void deliverChanges();
+    void renderThreadUpload();
     void renderThreadFree();
+    void renderThreadStop();
 };
 
 // Internal representation of data in the cache, referenced by
 // ImageTextureCacheEntry.
-struct ImageTextureCacheData : public std::enable_shared_from_this<ImageTextureCacheData>
+struct ImageTextureCacheData
 {
 public:
-    ImageTextureCacheData(ImageTextureCachePrivate *cache, const QString &key)
-        : key(key)
+    ImageTextureCacheData(ImageTextureCachePrivate *cache, const QString &source, int level)
+        : key(ImageTextureCachePrivate::cacheKey(source, level))
+        , source(source)
+        , level(level)
         , cache(cache)
-        , texture(nullptr)
+        , uploadPending(false)
         , cost(1)
+        , freePrev(nullptr)
+        , freeNext(nullptr)
+        , isFreeable(false)
         , refCount(0)
     {
     }
 
     const QString key;
+    const QString source;
+    const int level;
     ImageTextureCachePrivate * const cache;
 
+    // Image waiting for upload, released once the texture is created
     QImage image;
     QString error;
+    QSize loadedSize;
     QSize imageSize;
-    QSGTexture *texture;
-    int cost;
+    std::shared_ptr<QSGTexture> texture;
+    bool uploadPending;
+    qint64 cost;
+
+    // Position in the free list, protected by freeMutex
+    ImageTextureCacheData *freePrev;
+    ImageTextureCacheData *freeNext;
+    bool isFreeable;
 
     void ref() {
         if (!refCount.fetchAndAddOrdered(1)) {
-            cache->setFreeable(shared_from_this(), false);
+            cache->setFreeable(this, false);
         }
     }
 
     void deref()
     {
         if (!refCount.deref()) {
-            cache->setFreeable(shared_from_this(), true);
+            cache->setFreeable(this, true);
         }
     }
 
@@ -0,0 +1,254 @@
+#include "jpegdecoder.h"
+#include "uploadformat.h"
+#include <QLoggingCategory>
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+
+Q_DECLARE_LOGGING_CATEGORY(lcImageLoad)
+
+// libjpeg reports fatal errors through error_exit, which must not return. Every function
+// calling into libjpeg sets jump, and must not have any non-trivial local objects.
+struct JpegErrorManager
+{
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+    char message[JMSG_LENGTH_MAX];
+};
+
+static void jpegErrorExit(j_common_ptr cinfo)
+{
+    auto err = reinterpret_cast<JpegErrorManager*>(cinfo->err);
+    (*cinfo->err->format_message)(cinfo, err->message);
+    longjmp(err->jump, 1);
+}
+
+static void jpegOutputMessage(j_common_ptr)
+{
+    // Warnings are ignored
+}
+
+class JpegDecoderPrivate
+{
+public:
+    jpeg_decompress_struct cinfo;
+    JpegErrorManager err;
+
+    const uchar *data;
+    size_t size;
+
+    bool created = false;
+    bool headerRead = false;
+    bool started = false;
+    bool failed = false;
+    J_COLOR_SPACE colorSpace = JCS_UNKNOWN;
+    QImage::Format format = QImage::Format_Invalid;
+};
+
+JpegDecoder::JpegDecoder(const uchar *data, size_t size)
+    : d(new JpegDecoderPrivate)
+{
+    d->data = data;
+    d->size = size;
+    d->err.message[0] = 0;
+    d->cinfo.err = jpeg_std_error(&d->err.pub);
+    d->err.pub.error_exit = jpegErrorExit;
+    d->err.pub.output_message = jpegOutputMessage;
+
+    if (setjmp(d->err.jump)) {
+        d->failed = true;
+        return;
+    }
+    jpeg_create_decompress(&d->cinfo);
+    d->created = true;
+}
+
+JpegDecoder::~JpegDecoder()
+{
+    if (d->created)
+        jpeg_destroy_decompress(&d->cinfo);
+}
+
+bool JpegDecoder::readHeader()
+{
+    if (d->headerRead || d->failed)
+        return d->headerRead && !d->failed;
+
+    if (setjmp(d->err.jump)) {
+        d->failed = true;
+        return false;
+    }
+
+    jpeg_mem_src(&d->cinfo, const_cast<uchar*>(d->data), static_cast<unsigned long>(d->size));
+    if (jpeg_read_header(&d->cinfo, TRUE) != JPEG_HEADER_OK) {
+        d->failed = true;
+        return false;
+    }
+    d->headerRead = true;
+
+    // Decode straight to the layout of the scene graph's upload format. Grayscale stays
+    // one channel, which is cheaper to scale. CMYK and other rare color spaces are left to
+    // QImageReader.
+    switch (d->cinfo.jpeg_color_space) {
+    case JCS_GRAYSCALE:
+        d->colorSpace = JCS_GRAYSCALE;
+        d->format = QImage::Format_Grayscale8;
+        break;
+    case JCS_YCbCr:
+    case JCS_RGB:
+#if defined(JCS_EXTENSIONS) && QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+        d->colorSpace = JCS_EXT_RGBX;
+        d->format = opaqueUploadFormat;
+#elif defined(JCS_EXTENSIONS) && Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+        d->colorSpace = JCS_EXT_BGRX;
+        d->format = opaqueUploadFormat;
+#elif defined(JCS_EXTENSIONS)
+        d->colorSpace = JCS_EXT_XRGB;
+        d->format = opaqueUploadFormat;
+#else
+        d->colorSpace = JCS_RGB;
+        d->format = QImage::Format_RGB888;
+#endif
+        break;
+    default:
+        qCDebug(lcImageLoad) << "unsupported JPEG color space" << d->cinfo.jpeg_color_space;
+        d->failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+QSize JpegDecoder::size() const
+{
+    if (!d->headerRead)
+        return QSize();
+    return QSize(int(d->cinfo.image_width), int(d->cinfo.image_height));
+}
+
+QSize JpegDecoder::setMinimumOutputSize(const QSize &minimumSize)
+{
+    if (!readHeader() || d->started)
+        return outputSize();
+
+    unsigned int num = 8;
+    if (!minimumSize.isEmpty()) {
+        for (num = 1; num < 8; num++) {
+            // Output dimensions are rounded up, as in jpeg_calc_output_dimensions
+            unsigned int w = (d->cinfo.image_width * num + 7) / 8;
+            unsigned int h = (d->cinfo.image_height * num + 7) / 8;
+            if (w >= unsigned(minimumSize.width()) && h >= unsigned(minimumSize.height()))
+                break;
+        }
+    }
+
+    d->cinfo.scale_num = num;
+    d->cinfo.scale_denom = 8;
+    return outputSize();
+}
+
+QSize JpegDecoder::outputSize() const
+{
+    if (!d->headerRead)
+        return QSize();
+    if (d->started)
+        return QSize(int(d->cinfo.output_width), int(d->cinfo.output_height));
+
+    unsigned int num = d->cinfo.scale_num, denom = d->cinfo.scale_denom;
+    return QSize(int((d->cinfo.image_width * num + denom - 1) / denom),
+                 int((d->cinfo.image_height * num + denom - 1) / denom));
+}
+
+QImage::Format JpegDecoder::outputFormat() const
+{
+    return d->format;
+}
+
+bool JpegDecoder::start()
+{
+    if (!readHeader())
+        return false;
+    if (d->started)
+        return true;
+
+    if (setjmp(d->err.jump)) {
+        d->failed = true;
+        return false;
+    }
+
+    d->cinfo.out_color_space = d->colorSpace;
+    jpeg_start_decompress(&d->cinfo);
+    d->started = true;
+    return true;
+}
+
+int JpegDecoder::readLines(uchar **rows, int count)
+{
+    if (!d->started || d->failed)
+        return -1;
+
+    if (setjmp(d->err.jump)) {
+        d->failed = true;
+        return -1;
+    }
+
+    int read = 0;
+    while (read < count && d->cinfo.output_scanline < d->cinfo.output_height)
+        read += int(jpeg_read_scanlines(&d->cinfo, rows + read, JDIMENSION(count - read)));
+    return read;
+}
+
+int JpegDecoder::currentLine() const
+{
+    return d->started ? int(d->cinfo.output_scanline) : 0;
+}
+
+bool JpegDecoder::finish()
+{
+    if (!d->started || d->failed)
+        return false;
+
+    if (setjmp(d->err.jump)) {
+        d->failed = true;
+        return false;
+    }
+
+    if (d->cinfo.output_scanline < d->cinfo.output_height)
+        jpeg_abort_decompress(&d->cinfo);
+    else
+        jpeg_finish_decompress(&d->cinfo);
+    d->started = false;
+    return true;
+}
+
+QImage JpegDecoder::read()
+{
+    if (!start())
+        return QImage();
+
+    QImage image(outputSize(), outputFormat());
+    if (image.isNull()) {
+        finish();
+        return QImage();
+    }
+
+    const int chunk = 16;
+    uchar *rows[chunk];
+    while (currentLine() < image.height()) {
+        int count = qMin(chunk, image.height() - currentLine());
+        for (int i = 0; i < count; i++)
+            rows[i] = image.scanLine(currentLine() + i);
+        if (readLines(rows, count) < 1)
+            return QImage();
+    }
+
+    finish();
+    return image;
+}
+
+QString JpegDecoder::errorString() const
+{
+    if (d->err.message[0])
+        return QString::fromLatin1(d->err.message);
+    return d->failed ? QStringLiteral("Unsupported JPEG image") : QString();
+}
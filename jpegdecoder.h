@@ -0,0 +1,44 @@
+#pragma once
+
+#include <QImage>
+#include <QString>
+#include <memory>
+
+class JpegDecoderPrivate;
+
+// JpegDecoder decodes JPEG data in memory with libjpeg-turbo. The output is scaled during
+// decoding with the smallest DCT scale (1/8 to 8/8) that covers the requested size, and is
+// written directly into the image without intermediate copies.
+//
+// Images are decoded line by line, so callers can decode in chunks. The JPEG data must
+// remain valid for the lifetime of the decoder.
+class JpegDecoder
+{
+public:
+    JpegDecoder(const uchar *data, size_t size);
+    ~JpegDecoder();
+
+    // Returns false if the data is not a JPEG image this decoder can handle
+    bool readHeader();
+    QSize size() const;
+
+    // Choose the smallest scale that produces an image of at least minimumSize, and
+    // return the size of the output. An empty minimumSize decodes at full size.
+    QSize setMinimumOutputSize(const QSize &minimumSize);
+    QSize outputSize() const;
+    QImage::Format outputFormat() const;
+
+    bool start();
+    // Decode up to count lines into rows, returning the number of lines read or -1 on error
+    int readLines(uchar **rows, int count);
+    int currentLine() const;
+    bool finish();
+
+    // Decode the whole image in one call
+    QImage read();
+
+    QString errorString() const;
+
+private:
+    std::unique_ptr<JpegDecoderPrivate> d;
+};
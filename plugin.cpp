@@ -1,5 +1,10 @@
 #include <QQmlExtensionPlugin>
+#include <QQmlEngine>
 #include "speedyimage.h"
+#include "speedyimagefoldermodel.h"
+#include "speedyimageprefetcher.h"
+#include "cachebudget.h"
+#include "imageloader.h"
 
 class SpeedyImagePlugin : public QQmlExtensionPlugin
 {
@@ -10,6 +15,17 @@ public:
     void registerTypes(const char *uri)
     {
         qmlRegisterType<SpeedyImage>(uri, 1, 0, "SpeedyImage");
+        qmlRegisterType<SpeedyImageFolderModel>(uri, 1, 0, "SpeedyImageFolderModel");
+        qmlRegisterType<SpeedyImagePrefetcher>(uri, 1, 0, "SpeedyImagePrefetcher");
+        qmlRegisterSingletonType<CacheBudget>(uri, 1, 0, "CacheBudget",
+            [](QQmlEngine *, QJSEngine *) -> QObject* {
+                QQmlEngine::setObjectOwnership(CacheBudget::instance(), QQmlEngine::CppOwnership);
+                return CacheBudget::instance();
+            });
+        qmlRegisterSingletonType<ImageLoader>(uri, 1, 0, "ImageLoader",
+            [](QQmlEngine *, QJSEngine *) -> QObject* {
+                return ImageLoader::instance();
+            });
     }
 };
 
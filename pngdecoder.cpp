@@ -0,0 +1,188 @@
+#include "pngdecoder.h"
+#include "uploadformat.h"
+#include <QLoggingCategory>
+#include <csetjmp>
+#include <cstring>
+#include <png.h>
+
+Q_DECLARE_LOGGING_CATEGORY(lcImageLoad)
+
+// libpng reports fatal errors by longjmp to png_jmpbuf. Every function calling into libpng
+// sets it, and must not have any non-trivial local objects.
+class PngDecoderPrivate
+{
+public:
+    png_structp png = nullptr;
+    png_infop info = nullptr;
+
+    const uchar *data;
+    size_t size;
+    size_t offset = 0;
+
+    bool headerRead = false;
+    bool started = false;
+    bool failed = false;
+    bool premultiply = false;
+    int line = 0;
+    png_uint_32 width = 0;
+    png_uint_32 height = 0;
+    QImage::Format format = QImage::Format_Invalid;
+    char message[128];
+};
+
+static void pngRead(png_structp png, png_bytep out, png_size_t length)
+{
+    auto d = static_cast<PngDecoderPrivate*>(png_get_io_ptr(png));
+    if (length > d->size - d->offset)
+        png_error(png, "Premature end of data");
+    memcpy(out, d->data + d->offset, length);
+    d->offset += length;
+}
+
+static void pngError(png_structp png, png_const_charp message)
+{
+    auto d = static_cast<PngDecoderPrivate*>(png_get_error_ptr(png));
+    qstrncpy(d->message, message, sizeof(d->message));
+    png_longjmp(png, 1);
+}
+
+static void pngWarning(png_structp, png_const_charp)
+{
+    // Warnings are ignored
+}
+
+PngDecoder::PngDecoder(const uchar *data, size_t size)
+    : d(new PngDecoderPrivate)
+{
+    d->data = data;
+    d->size = size;
+    d->message[0] = 0;
+
+    d->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, d.get(), pngError, pngWarning);
+    if (d->png)
+        d->info = png_create_info_struct(d->png);
+    if (!d->info) {
+        d->failed = true;
+        return;
+    }
+    png_set_read_fn(d->png, d.get(), pngRead);
+}
+
+PngDecoder::~PngDecoder()
+{
+    if (d->png)
+        png_destroy_read_struct(&d->png, d->info ? &d->info : nullptr, nullptr);
+}
+
+bool PngDecoder::readHeader()
+{
+    if (d->headerRead || d->failed)
+        return d->headerRead && !d->failed;
+    if (d->size < 8 || png_sig_cmp(d->data, 0, 8) != 0) {
+        d->failed = true;
+        return false;
+    }
+
+    if (setjmp(png_jmpbuf(d->png))) {
+        d->failed = true;
+        return false;
+    }
+
+    png_read_info(d->png, d->info);
+
+    int bitDepth, colorType, interlace;
+    png_get_IHDR(d->png, d->info, &d->width, &d->height, &bitDepth, &colorType, &interlace, nullptr, nullptr);
+    if (interlace != PNG_INTERLACE_NONE) {
+        qCDebug(lcImageLoad) << "not streaming interlaced PNG";
+        d->failed = true;
+        return false;
+    }
+
+    // Everything is expanded to 8 bits per channel, as gray, RGBX or RGBA
+    bool alpha = (colorType & PNG_COLOR_MASK_ALPHA) || png_get_valid(d->png, d->info, PNG_INFO_tRNS);
+    png_set_expand(d->png);
+    png_set_strip_16(d->png);
+    if (!(colorType & PNG_COLOR_MASK_COLOR) && alpha)
+        png_set_gray_to_rgb(d->png);
+
+    // Color is produced in the byte order of the scene graph's upload format when possible
+    bool bgr = alphaUploadFormat == QImage::Format_ARGB32_Premultiplied && Q_BYTE_ORDER == Q_LITTLE_ENDIAN;
+    if ((colorType & PNG_COLOR_MASK_COLOR) || alpha) {
+        if (bgr)
+            png_set_bgr(d->png);
+    }
+
+    if (!(colorType & PNG_COLOR_MASK_COLOR) && !alpha) {
+        d->format = QImage::Format_Grayscale8;
+    } else if (alpha) {
+        d->format = bgr ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGBA8888_Premultiplied;
+        d->premultiply = true;
+    } else {
+        png_set_filler(d->png, 0xFF, PNG_FILLER_AFTER);
+        d->format = bgr ? QImage::Format_RGB32 : QImage::Format_RGBX8888;
+    }
+
+    png_read_update_info(d->png, d->info);
+    d->headerRead = true;
+    return true;
+}
+
+QSize PngDecoder::size() const
+{
+    if (!d->headerRead)
+        return QSize();
+    return QSize(int(d->width), int(d->height));
+}
+
+QImage::Format PngDecoder::outputFormat() const
+{
+    return d->format;
+}
+
+bool PngDecoder::start()
+{
+    if (!readHeader())
+        return false;
+    d->started = true;
+    return true;
+}
+
+int PngDecoder::readLines(uchar **rows, int count)
+{
+    if (!d->started || d->failed)
+        return -1;
+
+    if (setjmp(png_jmpbuf(d->png))) {
+        d->failed = true;
+        return -1;
+    }
+
+    int read = 0;
+    while (read < count && d->line < int(d->height)) {
+        png_read_row(d->png, rows[read], nullptr);
+        if (d->premultiply) {
+            uchar *p = rows[read];
+            for (png_uint_32 x = 0; x < d->width; x++, p += 4) {
+                const uint a = p[3];
+                p[0] = uchar((p[0] * a + 127) / 255);
+                p[1] = uchar((p[1] * a + 127) / 255);
+                p[2] = uchar((p[2] * a + 127) / 255);
+            }
+        }
+        read++;
+        d->line++;
+    }
+    return read;
+}
+
+int PngDecoder::currentLine() const
+{
+    return d->line;
+}
+
+QString PngDecoder::errorString() const
+{
+    if (d->message[0])
+        return QString::fromLatin1(d->message);
+    return d->failed ? QStringLiteral("Unsupported PNG image") : QString();
+}
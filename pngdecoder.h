@@ -0,0 +1,36 @@
+#pragma once
+
+#include <QImage>
+#include <QString>
+#include <memory>
+
+class PngDecoderPrivate;
+
+// PngDecoder decodes PNG data in memory with libpng, one line at a time, so that large
+// images can be scaled while decoding without holding the full image in memory.
+//
+// Output is Grayscale8, or the layout of the scene graph's upload format (see
+// uploadformat.h) with premultiplied alpha. Interlaced images can't be decoded line by
+// line, and are rejected by readHeader. The PNG data must remain valid
+// for the lifetime of the decoder.
+class PngDecoder
+{
+public:
+    PngDecoder(const uchar *data, size_t size);
+    ~PngDecoder();
+
+    // Returns false if the data is not a PNG image this decoder can handle
+    bool readHeader();
+    QSize size() const;
+    QImage::Format outputFormat() const;
+
+    bool start();
+    // Decode up to count lines into rows, returning the number of lines read or -1 on error
+    int readLines(uchar **rows, int count);
+    int currentLine() const;
+
+    QString errorString() const;
+
+private:
+    std::unique_ptr<PngDecoderPrivate> d;
+};
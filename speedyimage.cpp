@@ -1,11 +1,29 @@
 #include "speedyimage_p.h"
 #include "imageloader.h"
+#include "imagemetadataindex.h"
 #include <QSGSimpleTextureNode>
 #include <QQuickWindow>
+#include <QtMath>
+#include <limits>
 
 Q_LOGGING_CATEGORY(lcItem, "speedyimage.item")
 
-static ImageLoader *imgLoader;
+// Distance in pixels from the visible area that is worth one level of load priority
+static const int visibilityPriorityScale = 16;
+
+static int priorityForDistance(qreal distance)
+{
+    return -qRound(distance / visibilityPriorityScale);
+}
+
+// Distance between two rectangles, or zero if they intersect
+static qreal rectDistance(const QRectF &a, const QRectF &b)
+{
+    qreal dx = qMax<qreal>(0, qMax(b.left() - a.right(), a.left() - b.right()));
+    qreal dy = qMax<qreal>(0, qMax(b.top() - a.bottom(), a.top() - b.bottom()));
+    return qSqrt(dx * dx + dy * dy);
+}
+
 //
 // Return a rectangle fitting content within box while preserving
 // aspect ratio. If either dimension of box is zero, scale based
@@ -47,10 +65,6 @@ SpeedyImage::SpeedyImage(QQuickItem *parent)
     , d(new SpeedyImagePrivate(this))
 {
     setFlag(ItemHasContents);
-
-    if (!imgLoader) {
-        imgLoader = new ImageLoader;
-    }
 }
 
 SpeedyImage::~SpeedyImage()
@@ -69,8 +83,17 @@ void SpeedyImage::setSource(const QString &source)
 
     d->clearImage();
     d->source = source;
+    d->updateObserver();
 
     if (!d->source.isEmpty()) {
+        // A size known from an earlier load is available before anything loads, so layouts
+        // and a loadingSize with a zero dimension can settle right away
+        if (ImageMetadataIndex *index = ImageMetadataIndex::instance()) {
+            d->indexedSize = index->recordedImageSize(d->source);
+            if (d->loadingSize.isEmpty() && !d->indexedSize.isEmpty())
+                d->applyLoadingSize(d->loadingSize);
+        }
+
         // reloadImage will start loading the image (if possible) or immediately set it
         // from the cache entry. If the image is set immediately, status and other signals
         // will have been sent via cacheEntryChanged.
@@ -108,6 +131,26 @@ void SpeedyImage::setLoadingSize(QSize size) {
     d->applyLoadingSize(size);
 }
 
+QString SpeedyImage::loaderGroup() const
+{
+    return d->loaderGroup;
+}
+
+void SpeedyImage::setLoaderGroup(const QString &group)
+{
+    if (d->loaderGroup == group)
+        return;
+    d->loaderGroup = group;
+
+    // A pending load is moved to the new group's queue
+    if (!d->loadJob.isNull() && !d->loadJob.finished()) {
+        d->loadJob.cancel();
+        d->loadJob.reset();
+        d->reloadImage();
+    }
+    emit loaderGroupChanged();
+}
+
 SpeedyImage::Status SpeedyImage::status() const
 {
     return d->status;
@@ -115,6 +158,8 @@ SpeedyImage::Status SpeedyImage::status() const
 
 QSize SpeedyImage::imageSize() const
 {
+    if (d->cacheEntry.isNull())
+        return d->indexedSize;
     return d->cacheEntry.imageSize();
 }
 
@@ -143,19 +188,33 @@ void SpeedyImage::geometryChanged(const QRectF &newGeometry, const QRectF &oldGe
         d->applyLoadingSize(newGeometry.size().toSize());
 }
 
+namespace {
+
+// Holds a reference to its texture, which the cache may replace or evict before the node
+// is updated again
+class SpeedyImageNode : public QSGSimpleTextureNode
+{
+public:
+    std::shared_ptr<QSGTexture> sharedTexture;
+};
+
+}
+
 QSGNode *SpeedyImage::updatePaintNode(QSGNode *oldNode, UpdatePaintNodeData *)
 {
-    if (!d->cacheEntry.texture()) {
+    std::shared_ptr<QSGTexture> texture = d->cacheEntry.sharedTexture();
+    if (!texture) {
         delete oldNode;
         return nullptr;
     }
 
-    QSGSimpleTextureNode *node = static_cast<QSGSimpleTextureNode*>(oldNode);
+    SpeedyImageNode *node = static_cast<SpeedyImageNode*>(oldNode);
     if (!node) {
-        node = new QSGSimpleTextureNode;
+        node = new SpeedyImageNode;
         node->setFiltering(QSGTexture::Linear);
     }
-    node->setTexture(d->cacheEntry.texture());
+    node->setTexture(texture.get());
+    node->sharedTexture = texture;
     node->setRect(d->paintRect);
 
     return node;
@@ -172,24 +231,46 @@ SpeedyImagePrivate::SpeedyImagePrivate(SpeedyImage *q)
     : q(q)
     , status(SpeedyImage::Null)
     , componentComplete(false)
+    , deferredLoad(false)
     , explicitLoadingSize(false)
 {
     connect(q, &QQuickItem::windowChanged, this, &SpeedyImagePrivate::setWindow);
 }
 
+SpeedyImagePrivate::~SpeedyImagePrivate()
+{
+    if (observedCache)
+        observedCache->removeObserver(observedSource, this);
+}
+
+// Observe the cache entries of source in the current window's cache
+void SpeedyImagePrivate::updateObserver()
+{
+    if (observedCache == imageCache && observedSource == source)
+        return;
+
+    if (observedCache)
+        observedCache->removeObserver(observedSource, this);
+    observedCache = imageCache;
+    observedSource = source;
+    if (observedCache && !observedSource.isEmpty())
+        observedCache->addObserver(observedSource, this);
+}
+
 void SpeedyImagePrivate::setWindow(QQuickWindow *window)
 {
     if (imageCache) {
-        disconnect(imageCache.get(), nullptr, this, nullptr);
         imageCache.reset();
+        updateObserver();
         // Must be cleared because cacheEntry's texture is specific to a window.
-        // If possible, reloadImage below will fill it in from the new imageCache.
+        // If possible, reloadImage below will fill it in from the new imageCache, which
+        // only needs an upload if the image is still in the shared DecodedImageCache.
         clearImage();
     }
 
     if (window) {
         imageCache = ImageTextureCache::forWindow(window);
-        connect(imageCache.get(), &ImageTextureCache::changed, this, &SpeedyImagePrivate::cacheEntryChanged);
+        updateObserver();
         connect(window, &QQuickWindow::sceneGraphInitialized, this, &SpeedyImagePrivate::reloadImage);
 
         // Trigger reload in case one was blocked by not having imageCache earlier. Has no effect
@@ -201,7 +282,12 @@ void SpeedyImagePrivate::setWindow(QQuickWindow *window)
 void SpeedyImagePrivate::clearImage()
 {
     cacheEntry.reset();
+    levelEntry.reset();
+    indexedSize = QSize();
+    loadJob.cancel();
     loadJob.reset();
+    deferredLoad = false;
+    trackVisibility(false);
     paintRect = QRectF();
     status = SpeedyImage::Null;
     q->update();
@@ -238,8 +324,8 @@ bool SpeedyImagePrivate::needsReloadForDrawSize()
         return false;
     }
 
-    QSizeF loadedSize = cacheEntry.loadedSize();
-    QSizeF imageSize = cacheEntry.imageSize();
+    QSizeF loadedSize = levelEntry.loadedSize();
+    QSizeF imageSize = levelEntry.imageSize();
     if (imageSize.isEmpty() || loadedSize.isEmpty()) {
         // If nothing is loaded yet, always reload for draw size; see reloadImage.
         return true;
@@ -269,53 +355,187 @@ void SpeedyImagePrivate::reloadImage()
         return;
     }
 
-    if (cacheEntry.isNull()) {
-        cacheEntry = imageCache->get(source);
+    // Each size level has its own entry, so that items of very different sizes showing
+    // the same source don't replace each other's textures
+    int level = ImageTextureCache::levelForSize(loadingSize);
+    if (levelEntry.isNull() || levelEntry.level() != level) {
+        if (!loadJob.isNull()) {
+            qCDebug(lcItem) << this << "cancelling load at level" << levelEntry.level() << "for level" << level;
+            loadJob.cancel();
+            loadJob.reset();
+        }
+        levelEntry = imageCache->get(source, level);
+    }
 
-        if (!cacheEntry.isEmpty()) {
-            // Call cacheEntryChanged to handle everything
-            cacheEntryChanged(source);
+    if (cacheEntry != levelEntry && !levelEntry.isEmpty()) {
+        // Call cacheEntryChanged to handle everything
+        cacheEntryChanged(source, level);
+    } else if (cacheEntry.isNull()) {
+        // Show the closest level available until this level is loaded
+        auto best = imageCache->getBest(source, level);
+        if (!best.isNull()) {
+            qCDebug(lcItem) << this << "using level" << best.level() << "while loading level" << level;
+            setEntry(best);
         }
     }
 
-    if ((!cacheEntry.isEmpty() && !needsReloadForDrawSize()) || !cacheEntry.error().isEmpty()) {
+    if ((!levelEntry.isEmpty() && !needsReloadForDrawSize()) || !levelEntry.error().isEmpty()) {
         // Use cache entry
         return;
     }
 
+    if (levelEntry.isUploadPending()) {
+        // Loaded and waiting for the render thread; changed will follow
+        return;
+    }
+
+    QSize drawSize = ImageTextureCache::levelDrawSize(loadingSize, level);
     if (!loadJob.isNull()) {
         // We can attempt to change the drawSize on an existing job, but there
         // is no guarantee it will take effect. That case can be handled with a
         // check in setImage that will fire off a new job at a larger drawSize
         // if the result is insufficient, and we'll still have an upscale to display
         // meanwhile.
-        if (loadingSize != loadJob.drawSize()) {
-            qCDebug(lcItem) << this << "updating load size on existing job to" << loadingSize;
-            loadJob.setDrawSize(loadingSize);
+        if (drawSize != loadJob.drawSize()) {
+            qCDebug(lcItem) << this << "updating load size on existing job to" << drawSize;
+            loadJob.setDrawSize(drawSize);
         }
     } else if (imageCache) {
+        // Items far outside of the visible area wait until they come closer
+        qreal distance = visibleDistance();
+        if (distance > cancelDistance()) {
+            qCDebug(lcItem) << this << "deferring load of" << source << "at distance" << distance;
+            deferredLoad = true;
+            trackVisibility(true);
+            return;
+        }
+        deferredLoad = false;
+
         // Copy for lambda
         auto src = source;
         std::shared_ptr<ImageTextureCache> cache = imageCache;
 
-        loadJob = imgLoader->enqueue(source, loadingSize, 0,
-             [src,cache](const ImageLoaderJob &job) {
+        loadJob = ImageLoader::forGroup(loaderGroup)->enqueue(source, drawSize, priorityForDistance(distance),
+             [src,level,cache](const ImageLoaderJob &job) {
                 // Cache will signal the update to the cache entry
                 if (!job.error().isEmpty())
-                    cache->insert(src, job.error());
+                    cache->insert(src, level, job.error());
                 else
-                    cache->insert(src, job.result(), job.imageSize());
+                    cache->insert(src, level, job.result(), job.imageSize());
              });
+        trackVisibility(true);
+    }
+}
+
+// Distance in pixels between the item and the visible part of the window, including the
+// clip of any ancestors. Zero if the item is at least partially visible.
+qreal SpeedyImagePrivate::visibleDistance() const
+{
+    QQuickWindow *window = q->window();
+    if (!window)
+        return 0;
+
+    QRectF rect = q->mapRectToScene(QRectF(0, 0, q->width(), q->height()));
+    qreal distance = rectDistance(rect, QRectF(QPointF(0, 0), QSizeF(window->size())));
+    for (QQuickItem *p = q->parentItem(); p; p = p->parentItem()) {
+        if (p->clip())
+            distance = qMax(distance, rectDistance(rect, p->mapRectToScene(p->clipRect())));
     }
+    return distance;
+}
+
+// Loads are cancelled beyond this distance from the visible area. Configurable in pixels
+// with SPEEDYIMAGE_CANCEL_DISTANCE, and by default twice the size of the window.
+qreal SpeedyImagePrivate::cancelDistance() const
+{
+    static const int envDistance = qgetenv("SPEEDYIMAGE_CANCEL_DISTANCE").toInt();
+    if (envDistance > 0)
+        return envDistance;
+
+    QQuickWindow *window = q->window();
+    if (!window || window->size().isEmpty())
+        return std::numeric_limits<qreal>::infinity();
+    return 2 * qMax(window->width(), window->height());
 }
 
-void SpeedyImagePrivate::cacheEntryChanged(const QString &key)
+void SpeedyImagePrivate::trackVisibility(bool enable)
 {
-    if (key != source)
+    if (enable == bool(visibilityConnection))
         return;
 
-    qCDebug(lcItem) << this << "cache updated for" << key;
-    loadJob.reset();
+    if (enable && q->window()) {
+        visibilityConnection = connect(q->window(), &QQuickWindow::afterAnimating, this, &SpeedyImagePrivate::updateVisibility);
+    } else if (!enable) {
+        disconnect(visibilityConnection);
+        visibilityConnection = QMetaObject::Connection();
+    }
+}
+
+// Called on each frame while loading to follow the item as it moves or scrolls
+void SpeedyImagePrivate::updateVisibility()
+{
+    qreal distance = visibleDistance();
+
+    if (!loadJob.isNull()) {
+        if (distance > cancelDistance()) {
+            qCDebug(lcItem) << this << "cancelling load of" << source << "at distance" << distance;
+            loadJob.cancel();
+            loadJob.reset();
+            deferredLoad = true;
+            return;
+        }
+
+        int priority = priorityForDistance(distance);
+        if (priority != loadJob.priority())
+            loadJob.setPriority(priority);
+    } else if (deferredLoad) {
+        // Resume a little inside of the cancel distance, to avoid repeatedly cancelling
+        // items that are moving around the edge
+        if (distance <= cancelDistance() * 0.75)
+            reloadImage();
+    } else {
+        trackVisibility(false);
+    }
+}
+
+void SpeedyImagePrivate::cacheEntryChanged(const QString &key, int level)
+{
+    if (key != source || levelEntry.isNull())
+        return;
+
+    if (level != levelEntry.level()) {
+        // Another level of this source was loaded, which is only interesting if there is
+        // nothing to show yet
+        if (cacheEntry.isNull()) {
+            auto best = imageCache->getBest(source, levelEntry.level());
+            if (!best.isNull()) {
+                qCDebug(lcItem) << this << "using level" << best.level() << "while loading level" << levelEntry.level();
+                setEntry(best);
+            }
+        }
+        return;
+    }
+
+    qCDebug(lcItem) << this << "cache updated for" << key << "at level" << level;
+    // The job is kept if this was a preview, because the final result is still coming
+    if (loadJob.isNull() || loadJob.finished()) {
+        loadJob.reset();
+        deferredLoad = false;
+        trackVisibility(false);
+    }
+    setEntry(levelEntry);
+
+    // Reload the image again if drawSize has changed and needs a larger scale
+    if (needsReloadForDrawSize())
+    {
+        qCDebug(lcItem) << this << "draw size increased while loading, reloading at larger size";
+        reloadImage();
+    }
+}
+
+void SpeedyImagePrivate::setEntry(const ImageTextureCacheEntry &entry)
+{
+    cacheEntry = entry;
     q->update();
 
     auto oldStatus = status;
@@ -338,13 +558,6 @@ void SpeedyImagePrivate::cacheEntryChanged(const QString &key)
         if (loadingSize.isEmpty())
             applyLoadingSize(loadingSize);
     }
-
-    // Reload the image again if drawSize has changed and needs a larger scale
-    if (needsReloadForDrawSize())
-    {
-        qCDebug(lcItem) << this << "draw size increased while loading, reloading at larger size";
-        reloadImage();
-    }
 }
 
 bool SpeedyImagePrivate::calcPaintRect()
@@ -9,6 +9,7 @@ class SpeedyImage : public QQuickItem
     Q_OBJECT
     Q_PROPERTY(QString source READ source WRITE setSource NOTIFY sourceChanged)
     Q_PROPERTY(QSize loadingSize READ loadingSize WRITE setLoadingSize NOTIFY loadingSizeChanged)
+    Q_PROPERTY(QString loaderGroup READ loaderGroup WRITE setLoaderGroup NOTIFY loaderGroupChanged)
 
     Q_PROPERTY(Status status READ status NOTIFY statusChanged)
     Q_PROPERTY(QSize imageSize READ imageSize NOTIFY imageSizeChanged)
@@ -35,14 +36,23 @@ public:
     QSize loadingSize() const;
     void setLoadingSize(QSize size);
 
+    // Images are loaded by the ImageLoader for this group, which has its own workers. For
+    // example, full screen images can use a separate group, so that thumbnails are never
+    // waiting behind them. The default is an empty name, for the default loader.
+    QString loaderGroup() const;
+    void setLoaderGroup(const QString &group);
+
     Status status() const;
 
+    // Known as soon as the source is set if the image was loaded before, from the
+    // ImageMetadataIndex, and otherwise once the image has loaded
     QSize imageSize() const;
     QSizeF paintedSize() const;
 
 signals:
     void sourceChanged();
     void loadingSizeChanged();
+    void loaderGroupChanged();
     void statusChanged();
     void imageSizeChanged();
     void paintedSizeChanged();
@@ -9,13 +9,73 @@ QML_FILES = qmldir
 
 SOURCES += plugin.cpp \
     speedyimage.cpp \
+    speedyimagefoldermodel.cpp \
+    speedyimageprefetcher.cpp \
     imageloader.cpp \
+    imagediskcache.cpp \
+    embeddedthumbnail.cpp \
+    imagescaler.cpp \
+    decodedimagecache.cpp \
+    cachebudget.cpp \
+    cgroup.cpp \
+    filereader.cpp \
+    imagemetadataindex.cpp \
     imagetexturecache.cpp
 HEADERS += speedyimage.h \
     speedyimage_p.h \
+    speedyimagefoldermodel.h \
+    speedyimagefoldermodel_p.h \
+    speedyimageprefetcher.h \
+    speedyimageprefetcher_p.h \
     imageloader.h \
     imageloader_p.h \
+    imagediskcache.h \
+    imagediskcache_p.h \
+    embeddedthumbnail.h \
+    imagescaler.h \
+    uploadformat.h \
+    decodedimagecache.h \
+    decodedimagecache_p.h \
+    cachebudget.h \
+    cachebudget_p.h \
+    cgroup.h \
+    filereader.h \
+    filereader_p.h \
+    imagemetadataindex.h \
+    imagemetadataindex_p.h \
     imagetexturecache.h \
     imagetexturecache_p.h
 
+# libjpeg-turbo is used to decode JPEG directly at a scaled size when available
+packagesExist(libjpeg) {
+    CONFIG += link_pkgconfig
+    PKGCONFIG += libjpeg
+    DEFINES += SPEEDYIMAGE_HAVE_LIBJPEG
+    SOURCES += jpegdecoder.cpp
+    HEADERS += jpegdecoder.h
+}
+
+# libpng is used to decode large PNG images line by line
+packagesExist(libpng) {
+    CONFIG += link_pkgconfig
+    PKGCONFIG += libpng
+    DEFINES += SPEEDYIMAGE_HAVE_LIBPNG
+    SOURCES += pngdecoder.cpp
+    HEADERS += pngdecoder.h
+}
+
+# Decoded thumbnails can be shared between processes in shared memory
+unix {
+    DEFINES += SPEEDYIMAGE_HAVE_SHARED_CACHE
+    SOURCES += imagesharedcache.cpp
+    HEADERS += imagesharedcache.h \
+        imagesharedcache_p.h
+    linux: LIBS += -lrt -lpthread
+}
+
+# Files are read through io_uring when the kernel headers have it, falling back to threads
+linux:exists(/usr/include/linux/io_uring.h) {
+    DEFINES += SPEEDYIMAGE_HAVE_IO_URING
+}
+
 load(qml_plugin)
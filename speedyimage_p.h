@@ -6,7 +6,7 @@
 #include <memory>
 #include <QSGTexture>
 
-class SpeedyImagePrivate : public QObject
+class SpeedyImagePrivate : public QObject, public ImageTextureCacheObserver
 {
     Q_OBJECT
 
@@ -14,26 +14,49 @@ public:
     SpeedyImage *q;
 
     QString source;
+    QString loaderGroup;
     SpeedyImage::Status status;
     bool componentComplete;
 
     std::shared_ptr<ImageTextureCache> imageCache;
+    // Cache and source this item is registered to observe
+    std::shared_ptr<ImageTextureCache> observedCache;
+    QString observedSource;
+    // Entry that is displayed, which may be from another size level until levelEntry loads
     ImageTextureCacheEntry cacheEntry;
+    // Entry at the size level for loadingSize
+    ImageTextureCacheEntry levelEntry;
     ImageLoaderJob loadJob;
 
+    // While loading, visibility is checked each frame to update the load priority
+    QMetaObject::Connection visibilityConnection;
+    // Set if loading was deferred or cancelled because the item is far out of view
+    bool deferredLoad;
+
     bool explicitLoadingSize;
     QSize loadingSize;
+    // Size from ImageMetadataIndex, until an entry is displayed
+    QSize indexedSize;
     QRectF paintRect;
 
     SpeedyImagePrivate(SpeedyImage *q);
+    ~SpeedyImagePrivate();
 
     void clearImage();
     void reloadImage();
     bool calcPaintRect();
     void applyLoadingSize(QSize size);
     bool needsReloadForDrawSize();
+    void setEntry(const ImageTextureCacheEntry &entry);
+    void updateObserver();
+
+    void cacheEntryChanged(const QString &key, int level) override;
+
+    qreal visibleDistance() const;
+    qreal cancelDistance() const;
+    void trackVisibility(bool enable);
 
 public slots:
     void setWindow(QQuickWindow *window);
-    void cacheEntryChanged(const QString &key);
+    void updateVisibility();
 };
@@ -0,0 +1,696 @@
+#include "speedyimagefoldermodel_p.h"
+#include "imagemetadataindex.h"
+#include <QBuffer>
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QLoggingCategory>
+#include <QUrl>
+#include <algorithm>
+#include <iterator>
+#include <thread>
+
+#ifdef Q_OS_LINUX
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+Q_LOGGING_CATEGORY(lcFolderModel, "speedyimage.folder")
+
+// Rows are delivered in batches of batchSize, after a smaller first batch so that the first
+// screen shows as soon as possible
+static const int firstBatchSize = 256;
+static const int batchSize = 4096;
+
+// Prefetched reads are released after this long, whether or not anything loaded them
+static const int prefetchHoldTime = 10000;
+// Bytes of files read ahead for one scan, so that large files don't hold much memory
+static const qint64 prefetchMaxBytes = 64 * 1048576;
+// Bytes read to find the size of an image, and the larger read for files with a header that
+// doesn't fit, like a JPEG with a large embedded thumbnail
+static const qint64 probeBytes = 64 * 1024;
+static const qint64 probeMaxBytes = 1024 * 1024;
+// Sizes found by probing are delivered to the model in batches of this many
+static const int probeBatchSize = 256;
+
+#ifdef Q_OS_LINUX
+struct LinuxDirent64
+{
+    quint64 d_ino;
+    qint64 d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+#endif
+
+FolderNameFilter::FolderNameFilter(const QStringList &filters)
+{
+    if (filters.isEmpty())
+        suffixes.append(QString());
+
+    for (const QString &filter : filters) {
+        QString suffix = filter.mid(1);
+        if (filter.startsWith(QLatin1Char('*')) && !suffix.contains(QLatin1Char('*')) &&
+            !suffix.contains(QLatin1Char('?')) && !suffix.contains(QLatin1Char('[')))
+        {
+            suffixes.append(suffix);
+        } else {
+            patterns.append(QRegularExpression(QRegularExpression::wildcardToRegularExpression(filter),
+                                               QRegularExpression::CaseInsensitiveOption));
+        }
+    }
+}
+
+bool FolderNameFilter::matches(const QString &name) const
+{
+    for (const QString &suffix : suffixes) {
+        if (name.endsWith(suffix, Qt::CaseInsensitive))
+            return true;
+    }
+    for (const QRegularExpression &pattern : patterns) {
+        if (pattern.match(name).hasMatch())
+            return true;
+    }
+    return false;
+}
+
+FolderScan::FolderScan(const QString &folder, const QStringList &nameFilters, SpeedyImageFolderModel::SortField sortField,
+                       bool sortReversed, int prefetchCount)
+    : prefix(folder.endsWith(QLatin1Char('/')) ? folder : folder + QLatin1Char('/'))
+    , filter(nameFilters)
+    , sortField(sortField)
+    , sortReversed(sortReversed)
+    , prefetchCount(prefetchCount)
+    , receiver(nullptr)
+    , scheduled(false)
+    , finished(false)
+    , failed(false)
+#ifdef Q_OS_LINUX
+    , dirFd(-1)
+#endif
+{
+}
+
+bool FolderScan::lessThan(const FolderEntry &a, const FolderEntry &b, SpeedyImageFolderModel::SortField field, bool reversed)
+{
+    if (reversed)
+        return lessThan(b, a, field, false);
+
+    if (field == SpeedyImageFolderModel::Time && a.modified != b.modified)
+        return a.modified > b.modified;
+    if (field == SpeedyImageFolderModel::Size && a.size != b.size)
+        return a.size > b.size;
+
+    int order = QString::compare(a.name, b.name, Qt::CaseInsensitive);
+    if (order != 0)
+        return order < 0;
+    return a.name < b.name;
+}
+
+bool FolderScan::isAbandoned()
+{
+    QMutexLocker l(&mutex);
+    return !receiver;
+}
+
+// Called with mutex held. Delivery is scheduled once for everything queued until it runs.
+void FolderScan::deliver()
+{
+    if (!receiver || scheduled)
+        return;
+    scheduled = true;
+    QMetaObject::invokeMethod(receiver, "deliverScan", Qt::QueuedConnection);
+}
+
+void FolderScan::run()
+{
+    scan();
+
+#ifdef Q_OS_LINUX
+    if (dirFd >= 0)
+        close(dirFd);
+    dirFd = -1;
+#endif
+}
+
+void FolderScan::scan()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    std::vector<FolderEntry> entries;
+    if (!listEntries(entries)) {
+        QMutexLocker l(&mutex);
+        finished = true;
+        failed = true;
+        deliver();
+        return;
+    }
+    qCDebug(lcFolderModel) << "listed" << entries.size() << "files in" << prefix << "in" << timer.elapsed() << "ms";
+
+    // Names are sorted before anything is stat'ed, so that rows are added in their final
+    // order as soon as each batch is stat'ed. Other orders need every file stat'ed first.
+    bool statFirst = sortField == SpeedyImageFolderModel::Time || sortField == SpeedyImageFolderModel::Size;
+    if (statFirst)
+        entries = statEntries(entries.begin(), entries.end());
+    sortEntries(entries);
+
+    // The first rows are probed right after the scan, and the rest at low priority after them
+    std::vector<FolderEntry> probes;
+    std::vector<FolderEntry> laterProbes;
+    int prefetchLeft = prefetchCount;
+    qint64 prefetchBytesLeft = prefetchMaxBytes;
+    size_t count = 0;
+    for (size_t pos = 0; pos < entries.size(); ) {
+        if (isAbandoned())
+            return;
+
+        size_t n = std::min(entries.size() - pos, size_t(pos ? batchSize : firstBatchSize));
+        auto begin = entries.begin() + pos;
+        std::vector<FolderEntry> batch;
+        if (statFirst)
+            batch.assign(std::make_move_iterator(begin), std::make_move_iterator(begin + n));
+        else
+            batch = statEntries(begin, begin + n);
+        pos += n;
+        count += batch.size();
+
+        // Start reading the first rows right away, so they are read in parallel with the
+        // rest of the scan and with loads of the first screen, which will share the reads.
+        // Images in the index were loaded before and are most likely cached, so they're left
+        // to the loader.
+        std::vector<FileRead> batchReads;
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (!batch[i].imageSize.isEmpty()) {
+                prefetchLeft--;
+                continue;
+            }
+            if (prefetchLeft-- <= 0) {
+                laterProbes.push_back(batch[i]);
+                continue;
+            }
+            probes.push_back(batch[i]);
+            if (batch[i].size <= prefetchBytesLeft) {
+                prefetchBytesLeft -= batch[i].size;
+                batchReads.push_back(FileReader::instance()->read(prefix + batch[i].name));
+            }
+        }
+
+        QMutexLocker l(&mutex);
+        rows.insert(rows.end(), std::make_move_iterator(batch.begin()), std::make_move_iterator(batch.end()));
+        this->reads.insert(this->reads.end(), batchReads.begin(), batchReads.end());
+        deliver();
+    }
+
+    {
+        QMutexLocker l(&mutex);
+        finished = true;
+        deliver();
+    }
+    qCDebug(lcFolderModel) << "read" << count << "images in" << prefix << "in" << timer.elapsed() << "ms";
+
+    probe(probes);
+    if (laterProbes.empty())
+        return;
+
+    // The rest only fill in sizes for the model, so they stay out of the way of loads
+#ifdef Q_OS_LINUX
+    setpriority(PRIO_PROCESS, id_t(syscall(SYS_gettid)), 19);
+#endif
+    probe(laterProbes);
+    qCDebug(lcFolderModel) << "probed" << probes.size() + laterProbes.size() << "images in" << prefix << "in" << timer.elapsed() << "ms";
+}
+
+bool FolderScan::listEntries(std::vector<FolderEntry> &entries)
+{
+#ifdef Q_OS_LINUX
+    dirFd = open(QFile::encodeName(prefix).constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd < 0) {
+        qCWarning(lcFolderModel) << "cannot open folder" << prefix << strerror(errno);
+        return false;
+    }
+
+    // Entries are read with a much larger buffer than readdir uses, and filtered by name and
+    // type before anything is stat'ed. Hidden files are skipped, as QDir does by default.
+    std::vector<char> buffer(256 * 1024);
+    for (;;) {
+        long size = syscall(SYS_getdents64, dirFd, buffer.data(), buffer.size());
+        if (size < 0) {
+            qCWarning(lcFolderModel) << "cannot read folder" << prefix << strerror(errno);
+            return false;
+        }
+        if (size == 0)
+            break;
+
+        for (long offset = 0; offset < size; ) {
+            const auto *entry = reinterpret_cast<const LinuxDirent64*>(buffer.data() + offset);
+            offset += entry->d_reclen;
+            if (entry->d_name[0] == '.')
+                continue;
+            if (entry->d_type != DT_REG && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)
+                continue;
+
+            FolderEntry folderEntry;
+            folderEntry.name = QFile::decodeName(entry->d_name);
+            if (filter.matches(folderEntry.name))
+                entries.push_back(std::move(folderEntry));
+        }
+
+        if (isAbandoned())
+            return false;
+    }
+    return true;
+#else
+    if (!QFileInfo(prefix).isDir()) {
+        qCWarning(lcFolderModel) << "cannot open folder" << prefix;
+        return false;
+    }
+
+    QDirIterator it(prefix, QDir::Files);
+    while (it.hasNext()) {
+        it.next();
+        QFileInfo info = it.fileInfo();
+        if (!filter.matches(info.fileName()))
+            continue;
+
+        FolderEntry folderEntry;
+        folderEntry.name = info.fileName();
+        folderEntry.size = info.size();
+        folderEntry.modified = info.lastModified().toMSecsSinceEpoch();
+        entries.push_back(std::move(folderEntry));
+    }
+    return true;
+#endif
+}
+
+// Stat entries and find their image size in the index, returning those that are files
+std::vector<FolderEntry> FolderScan::statEntries(std::vector<FolderEntry>::iterator begin, std::vector<FolderEntry>::iterator end)
+{
+    ImageMetadataIndex *index = ImageMetadataIndex::instance();
+    std::vector<FolderEntry> result;
+    result.reserve(size_t(end - begin));
+
+    for (auto it = begin; it != end; it++) {
+#ifdef Q_OS_LINUX
+        struct statx st;
+        if (statx(dirFd, QFile::encodeName(it->name).constData(), AT_STATX_SYNC_AS_STAT,
+                  STATX_TYPE | STATX_SIZE | STATX_MTIME, &st) != 0 || !S_ISREG(st.stx_mode))
+        {
+            continue;
+        }
+        it->size = qint64(st.stx_size);
+        it->modified = qint64(st.stx_mtime.tv_sec) * 1000 + st.stx_mtime.tv_nsec / 1000000;
+#endif
+
+        ImageMetadata metadata;
+        if (index && index->lookup(prefix + it->name, it->modified, it->size, metadata))
+            it->imageSize = metadata.size;
+        result.push_back(std::move(*it));
+    }
+    return result;
+}
+
+void FolderScan::sortEntries(std::vector<FolderEntry> &entries)
+{
+    if (sortField == SpeedyImageFolderModel::Unsorted)
+        return;
+
+    auto field = sortField;
+    bool reversed = sortReversed;
+    std::sort(entries.begin(), entries.end(), [field, reversed](const FolderEntry &a, const FolderEntry &b) {
+        return lessThan(a, b, field, reversed);
+    });
+}
+
+// Read the size of images from their headers, recording it in the index. Only the start of
+// each file is read, rather than waiting for the prefetched read of the whole file. Images
+// that were loaded into the index since they were stat'ed aren't read again.
+void FolderScan::probe(const std::vector<FolderEntry> &entries)
+{
+    ImageMetadataIndex *index = ImageMetadataIndex::instance();
+    std::vector<std::pair<QString,QSize>> sizes;
+
+    for (const FolderEntry &entry : entries) {
+        if (isAbandoned())
+            return;
+
+        if (int(sizes.size()) >= probeBatchSize) {
+            QMutexLocker l(&mutex);
+            imageSizes.insert(imageSizes.end(), sizes.begin(), sizes.end());
+            deliver();
+            sizes.clear();
+        }
+
+        QString path = prefix + entry.name;
+        ImageMetadata metadata;
+        if (index && index->lookup(path, entry.modified, entry.size, metadata)) {
+            sizes.emplace_back(entry.name, metadata.size);
+            continue;
+        }
+
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly))
+            continue;
+        QByteArray data;
+        QSize size;
+        QImageIOHandler::Transformations transform;
+        QByteArray format;
+        for (qint64 limit : { probeBytes, probeMaxBytes }) {
+            if (data.size() == file.size())
+                break;
+            data += file.read(limit - data.size());
+            QBuffer buffer(&data);
+            buffer.open(QIODevice::ReadOnly);
+            QImageReader rd(&buffer);
+            size = rd.size();
+            if (size.isEmpty())
+                continue;
+            transform = rd.transformation();
+            format = rd.format();
+            break;
+        }
+
+        if (transform & QImageIOHandler::TransformationRotate90)
+            size.transpose();
+        if (size.isEmpty())
+            continue;
+
+        if (index) {
+            metadata.size = size;
+            metadata.transform = transform;
+            metadata.format = format;
+            index->insert(path, metadata);
+        }
+        sizes.emplace_back(entry.name, size);
+    }
+
+    if (sizes.empty())
+        return;
+    QMutexLocker l(&mutex);
+    imageSizes.insert(imageSizes.end(), sizes.begin(), sizes.end());
+    deliver();
+}
+
+SpeedyImageFolderModel::SpeedyImageFolderModel(QObject *parent)
+    : QAbstractListModel(parent)
+    , d(new SpeedyImageFolderModelPrivate(this))
+{
+}
+
+SpeedyImageFolderModel::~SpeedyImageFolderModel()
+{
+}
+
+SpeedyImageFolderModelPrivate::SpeedyImageFolderModelPrivate(SpeedyImageFolderModel *q)
+    : q(q)
+    , nameFilters({ QStringLiteral("*.jpg"), QStringLiteral("*.jpeg"), QStringLiteral("*.png"), QStringLiteral("*.webp"),
+                    QStringLiteral("*.gif"), QStringLiteral("*.bmp"), QStringLiteral("*.tif"), QStringLiteral("*.tiff"),
+                    QStringLiteral("*.heic"), QStringLiteral("*.heif"), QStringLiteral("*.avif") })
+    , sortField(SpeedyImageFolderModel::Name)
+    , sortReversed(false)
+    , prefetchCount(32)
+    , status(SpeedyImageFolderModel::Null)
+    , scanScheduled(false)
+{
+    prefetchTimer.setSingleShot(true);
+    prefetchTimer.setInterval(prefetchHoldTime);
+    connect(&prefetchTimer, &QTimer::timeout, this, [this]() { prefetched.clear(); });
+}
+
+SpeedyImageFolderModelPrivate::~SpeedyImageFolderModelPrivate()
+{
+    abandonScan();
+}
+
+QString SpeedyImageFolderModel::folder() const
+{
+    return d->folder;
+}
+
+void SpeedyImageFolderModel::setFolder(const QString &folder)
+{
+    if (d->folder == folder)
+        return;
+    d->folder = folder;
+    d->scheduleScan();
+    emit folderChanged();
+}
+
+QStringList SpeedyImageFolderModel::nameFilters() const
+{
+    return d->nameFilters;
+}
+
+void SpeedyImageFolderModel::setNameFilters(const QStringList &filters)
+{
+    if (d->nameFilters == filters)
+        return;
+    d->nameFilters = filters;
+    d->scheduleScan();
+    emit nameFiltersChanged();
+}
+
+SpeedyImageFolderModel::SortField SpeedyImageFolderModel::sortField() const
+{
+    return d->sortField;
+}
+
+void SpeedyImageFolderModel::setSortField(SortField field)
+{
+    if (d->sortField == field)
+        return;
+    d->sortField = field;
+    d->sortRows();
+    emit sortFieldChanged();
+}
+
+bool SpeedyImageFolderModel::sortReversed() const
+{
+    return d->sortReversed;
+}
+
+void SpeedyImageFolderModel::setSortReversed(bool reversed)
+{
+    if (d->sortReversed == reversed)
+        return;
+    d->sortReversed = reversed;
+    d->sortRows();
+    emit sortReversedChanged();
+}
+
+int SpeedyImageFolderModel::prefetchCount() const
+{
+    return d->prefetchCount;
+}
+
+// Only applies to the next scan
+void SpeedyImageFolderModel::setPrefetchCount(int count)
+{
+    count = qMax(0, count);
+    if (d->prefetchCount == count)
+        return;
+    d->prefetchCount = count;
+    emit prefetchCountChanged();
+}
+
+SpeedyImageFolderModel::Status SpeedyImageFolderModel::status() const
+{
+    return d->status;
+}
+
+int SpeedyImageFolderModel::count() const
+{
+    return int(d->rows.size());
+}
+
+QString SpeedyImageFolderModel::filePath(int row) const
+{
+    if (row < 0 || row >= int(d->rows.size()))
+        return QString();
+    return d->prefix + d->rows[row].name;
+}
+
+void SpeedyImageFolderModel::refresh()
+{
+    d->scheduleScan();
+}
+
+int SpeedyImageFolderModel::rowCount(const QModelIndex &parent) const
+{
+    if (parent.isValid())
+        return 0;
+    return int(d->rows.size());
+}
+
+QVariant SpeedyImageFolderModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= int(d->rows.size()))
+        return QVariant();
+
+    const FolderEntry &entry = d->rows[index.row()];
+    switch (role) {
+    case Qt::DisplayRole:
+    case FileNameRole:
+        return entry.name;
+    case FilePathRole:
+        return d->prefix + entry.name;
+    case FileSizeRole:
+        return entry.size;
+    case FileModifiedRole:
+        return QDateTime::fromMSecsSinceEpoch(entry.modified);
+    case ImageWidthRole:
+        return qMax(0, entry.imageSize.width());
+    case ImageHeightRole:
+        return qMax(0, entry.imageSize.height());
+    }
+    return QVariant();
+}
+
+QHash<int,QByteArray> SpeedyImageFolderModel::roleNames() const
+{
+    return {
+        { FileNameRole, "fileName" },
+        { FilePathRole, "filePath" },
+        { FileSizeRole, "fileSize" },
+        { FileModifiedRole, "fileModified" },
+        { ImageWidthRole, "imageWidth" },
+        { ImageHeightRole, "imageHeight" }
+    };
+}
+
+// Scans start from the event loop, so that setting several properties at once scans once
+void SpeedyImageFolderModelPrivate::scheduleScan()
+{
+    if (scanScheduled)
+        return;
+    scanScheduled = true;
+    QMetaObject::invokeMethod(this, "startScan", Qt::QueuedConnection);
+}
+
+void SpeedyImageFolderModelPrivate::abandonScan()
+{
+    if (!scan)
+        return;
+    QMutexLocker l(&scan->mutex);
+    scan->receiver = nullptr;
+    l.unlock();
+    scan.reset();
+}
+
+void SpeedyImageFolderModelPrivate::setStatus(SpeedyImageFolderModel::Status newStatus)
+{
+    if (status == newStatus)
+        return;
+    status = newStatus;
+    emit q->statusChanged();
+}
+
+void SpeedyImageFolderModelPrivate::startScan()
+{
+    scanScheduled = false;
+    abandonScan();
+    prefetched.clear();
+    prefetchTimer.stop();
+
+    bool hadRows = !rows.empty();
+    q->beginResetModel();
+    rows.clear();
+    rowForName.clear();
+    q->endResetModel();
+    if (hadRows)
+        emit q->countChanged();
+
+    if (folder.isEmpty()) {
+        prefix.clear();
+        setStatus(SpeedyImageFolderModel::Null);
+        return;
+    }
+
+    QString path = folder;
+    if (path.startsWith(QLatin1String("file:")))
+        path = QUrl(path).toLocalFile();
+    scan = std::make_shared<FolderScan>(QDir::cleanPath(QDir(path).absolutePath()), nameFilters, sortField,
+                                        sortReversed, prefetchCount);
+    scan->receiver = this;
+    prefix = scan->prefix;
+    setStatus(SpeedyImageFolderModel::Loading);
+
+    std::thread(&FolderScan::run, scan).detach();
+}
+
+void SpeedyImageFolderModelPrivate::deliverScan()
+{
+    if (!scan)
+        return;
+
+    QMutexLocker l(&scan->mutex);
+    scan->scheduled = false;
+    std::vector<FolderEntry> newRows;
+    newRows.swap(scan->rows);
+    std::vector<std::pair<QString,QSize>> imageSizes;
+    imageSizes.swap(scan->imageSizes);
+    std::vector<FileRead> reads;
+    reads.swap(scan->reads);
+    bool finished = scan->finished;
+    bool failed = scan->failed;
+    l.unlock();
+
+    if (!newRows.empty()) {
+        int first = int(rows.size());
+        q->beginInsertRows(QModelIndex(), first, first + int(newRows.size()) - 1);
+        rows.insert(rows.end(), std::make_move_iterator(newRows.begin()), std::make_move_iterator(newRows.end()));
+        for (int i = first; i < int(rows.size()); i++)
+            rowForName.insert(rows[i].name, i);
+        q->endInsertRows();
+        emit q->countChanged();
+    }
+
+    if (!reads.empty()) {
+        prefetched.insert(prefetched.end(), reads.begin(), reads.end());
+        prefetchTimer.start();
+    }
+
+    for (const auto &size : imageSizes) {
+        int row = rowForName.value(size.first, -1);
+        if (row < 0)
+            continue;
+        rows[row].imageSize = size.second;
+        QModelIndex index = q->index(row);
+        emit q->dataChanged(index, index, { SpeedyImageFolderModel::ImageWidthRole, SpeedyImageFolderModel::ImageHeightRole });
+    }
+
+    if (finished && status == SpeedyImageFolderModel::Loading)
+        setStatus(failed ? SpeedyImageFolderModel::Error : SpeedyImageFolderModel::Ready);
+}
+
+// Rows that have all been read are sorted in place. The original order can't be restored
+// without reading the folder again, and a scan in progress is restarted in the new order.
+void SpeedyImageFolderModelPrivate::sortRows()
+{
+    if (status != SpeedyImageFolderModel::Ready || sortField == SpeedyImageFolderModel::Unsorted) {
+        if (status != SpeedyImageFolderModel::Null)
+            scheduleScan();
+        return;
+    }
+
+    auto field = sortField;
+    bool reversed = sortReversed;
+    q->beginResetModel();
+    std::sort(rows.begin(), rows.end(), [field, reversed](const FolderEntry &a, const FolderEntry &b) {
+        return FolderScan::lessThan(a, b, field, reversed);
+    });
+    for (int i = 0; i < int(rows.size()); i++)
+        rowForName.insert(rows[i].name, i);
+    q->endResetModel();
+}
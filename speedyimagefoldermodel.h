@@ -0,0 +1,108 @@
+#pragma once
+
+#include <QAbstractListModel>
+#include <QStringList>
+#include <memory>
+
+class SpeedyImageFolderModelPrivate;
+
+// SpeedyImageFolderModel lists the images in a folder for galleries, like FolderListModel,
+// without touching the disk on the GUI thread. The folder is read and each file is stat'ed
+// on a background thread, and rows are added in batches as they're ready, so the first screen
+// of a large folder shows while the rest is still being read. Sorting by name (the default)
+// or unsorted adds rows in their final order, and only the first batch needs to be stat'ed
+// before it appears. Sorting by time or size needs every file stat'ed first.
+//
+// The size of images that were loaded before is known from the ImageMetadataIndex. For the
+// first prefetchCount rows that aren't in the index, the files are read ahead through the
+// FileReader, up to 64MB in total, so that the loader shares those reads when the items for
+// the first screen request them. The start of those files is read to find their size, and
+// then the start of every other file that isn't in the index, at low priority. The image size
+// of a row is 0 until it's known, and dataChanged is emitted when it's found.
+//
+// Changes to the folder after it has been read are not noticed; set the folder again or call
+// refresh() to read it again.
+class SpeedyImageFolderModel : public QAbstractListModel
+{
+    Q_OBJECT
+    Q_PROPERTY(QString folder READ folder WRITE setFolder NOTIFY folderChanged)
+    Q_PROPERTY(QStringList nameFilters READ nameFilters WRITE setNameFilters NOTIFY nameFiltersChanged)
+    Q_PROPERTY(SortField sortField READ sortField WRITE setSortField NOTIFY sortFieldChanged)
+    Q_PROPERTY(bool sortReversed READ sortReversed WRITE setSortReversed NOTIFY sortReversedChanged)
+    Q_PROPERTY(int prefetchCount READ prefetchCount WRITE setPrefetchCount NOTIFY prefetchCountChanged)
+
+    Q_PROPERTY(Status status READ status NOTIFY statusChanged)
+    Q_PROPERTY(int count READ count NOTIFY countChanged)
+
+public:
+    enum Status {
+        Null,
+        Ready,
+        Loading,
+        Error
+    };
+    Q_ENUM(Status)
+
+    // Like QDir, time sorts newest first and size largest first
+    enum SortField {
+        Unsorted,
+        Name,
+        Time,
+        Size
+    };
+    Q_ENUM(SortField)
+
+    enum Roles {
+        FileNameRole = Qt::UserRole + 1,
+        FilePathRole,
+        FileSizeRole,
+        FileModifiedRole,
+        // Size of the image after orientation, or 0 if it's not known yet
+        ImageWidthRole,
+        ImageHeightRole
+    };
+
+    explicit SpeedyImageFolderModel(QObject *parent = nullptr);
+    virtual ~SpeedyImageFolderModel();
+
+    // A local path, or a file URL
+    QString folder() const;
+    void setFolder(const QString &folder);
+
+    // Wildcard patterns for file names, matched without case. The default matches the
+    // usual image suffixes.
+    QStringList nameFilters() const;
+    void setNameFilters(const QStringList &filters);
+
+    SortField sortField() const;
+    void setSortField(SortField field);
+    bool sortReversed() const;
+    void setSortReversed(bool reversed);
+
+    // Number of rows at the start of the model to read ahead, default 32
+    int prefetchCount() const;
+    void setPrefetchCount(int count);
+
+    Status status() const;
+    int count() const;
+
+    Q_INVOKABLE QString filePath(int row) const;
+    Q_INVOKABLE void refresh();
+
+    virtual int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    virtual QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+    virtual QHash<int,QByteArray> roleNames() const override;
+
+signals:
+    void folderChanged();
+    void nameFiltersChanged();
+    void sortFieldChanged();
+    void sortReversedChanged();
+    void prefetchCountChanged();
+    void statusChanged();
+    void countChanged();
+
+private:
+    friend class SpeedyImageFolderModelPrivate;
+    std::unique_ptr<SpeedyImageFolderModelPrivate> d;
+};
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "speedyimagefoldermodel.h"
+#include "filereader.h"
+#include <QHash>
+#include <QMutex>
+#include <QRegularExpression>
+#include <QSize>
+#include <QTimer>
+#include <vector>
+
+struct FolderEntry
+{
+    QString name;
+    qint64 size = 0;
+    // Modification time in msecs since the epoch
+    qint64 modified = 0;
+    // Size of the image after orientation, if it's known
+    QSize imageSize;
+};
+
+// Matches file names against wildcard patterns. Patterns that are only a wildcard followed
+// by a suffix, which is almost all of them, are compared directly rather than by expression.
+struct FolderNameFilter
+{
+    QStringList suffixes;
+    QVector<QRegularExpression> patterns;
+
+    explicit FolderNameFilter(const QStringList &filters);
+    bool matches(const QString &name) const;
+};
+
+// A scan of one folder, shared by the model and the thread reading the folder. The thread
+// queues results here and schedules delivery to the model, until the model abandons the
+// scan by clearing receiver.
+class FolderScan
+{
+public:
+    FolderScan(const QString &folder, const QStringList &nameFilters, SpeedyImageFolderModel::SortField sortField,
+               bool sortReversed, int prefetchCount);
+
+    // Absolute path of the folder, ending in a separator
+    const QString prefix;
+    const FolderNameFilter filter;
+    const SpeedyImageFolderModel::SortField sortField;
+    const bool sortReversed;
+    const int prefetchCount;
+
+    // Protects everything below
+    QMutex mutex;
+    SpeedyImageFolderModelPrivate *receiver;
+    bool scheduled;
+    std::vector<FolderEntry> rows;
+    std::vector<std::pair<QString,QSize>> imageSizes;
+    std::vector<FileRead> reads;
+    bool finished;
+    bool failed;
+
+    static bool lessThan(const FolderEntry &a, const FolderEntry &b, SpeedyImageFolderModel::SortField field, bool reversed);
+
+    // Runs on the scan thread
+    void run();
+
+private:
+    bool isAbandoned();
+    void scan();
+    bool listEntries(std::vector<FolderEntry> &entries);
+    std::vector<FolderEntry> statEntries(std::vector<FolderEntry>::iterator begin, std::vector<FolderEntry>::iterator end);
+    void sortEntries(std::vector<FolderEntry> &entries);
+    void probe(const std::vector<FolderEntry> &entries);
+    void deliver();
+
+#ifdef Q_OS_LINUX
+    int dirFd;
+#endif
+};
+
+class SpeedyImageFolderModelPrivate : public QObject
+{
+    Q_OBJECT
+
+public:
+    SpeedyImageFolderModelPrivate(SpeedyImageFolderModel *q);
+    ~SpeedyImageFolderModelPrivate();
+
+    SpeedyImageFolderModel *q;
+
+    QString folder;
+    QStringList nameFilters;
+    SpeedyImageFolderModel::SortField sortField;
+    bool sortReversed;
+    int prefetchCount;
+    SpeedyImageFolderModel::Status status;
+
+    // Absolute path of the folder being shown, ending in a separator
+    QString prefix;
+    std::vector<FolderEntry> rows;
+    // Row of each file name, for updating rows by name
+    QHash<QString,int> rowForName;
+    std::shared_ptr<FolderScan> scan;
+    bool scanScheduled;
+
+    // Reads of the first rows, held for a while so that loads of them share the reads
+    std::vector<FileRead> prefetched;
+    QTimer prefetchTimer;
+
+    void scheduleScan();
+    void abandonScan();
+    void setStatus(SpeedyImageFolderModel::Status status);
+    void sortRows();
+
+public slots:
+    void startScan();
+    void deliverScan();
+};
@@ -0,0 +1,256 @@
+#include "speedyimageprefetcher_p.h"
+#include "decodedimagecache.h"
+#include "imagetexturecache.h"
+#include <QLoggingCategory>
+#include <QSet>
+
+Q_LOGGING_CATEGORY(lcPrefetch, "speedyimage.prefetch")
+
+void PrefetchResults::add(const QString &source, qint64 bytes)
+{
+    QMutexLocker l(&mutex);
+    finished.emplace_back(source, bytes);
+    if (!receiver || scheduled)
+        return;
+    scheduled = true;
+    QMetaObject::invokeMethod(receiver, "deliverResults", Qt::QueuedConnection);
+}
+
+SpeedyImagePrefetcher::SpeedyImagePrefetcher(QObject *parent)
+    : QObject(parent)
+    , d(new SpeedyImagePrefetcherPrivate(this))
+{
+}
+
+SpeedyImagePrefetcher::~SpeedyImagePrefetcher()
+{
+}
+
+SpeedyImagePrefetcherPrivate::SpeedyImagePrefetcherPrivate(SpeedyImagePrefetcher *q)
+    : q(q)
+    , priority(-500)
+    , results(std::make_shared<PrefetchResults>())
+    , loadedBytes(0)
+    , updateScheduled(false)
+{
+    results->receiver = this;
+    // Created here on the GUI thread, because it follows the CacheBudget; loads insert
+    // into it from workers
+    DecodedImageCache::instance();
+}
+
+SpeedyImagePrefetcherPrivate::~SpeedyImagePrefetcherPrivate()
+{
+    QMutexLocker l(&results->mutex);
+    results->receiver = nullptr;
+    l.unlock();
+
+    for (auto &job : jobs)
+        job.cancel();
+}
+
+QStringList SpeedyImagePrefetcher::sources() const
+{
+    return d->sources;
+}
+
+void SpeedyImagePrefetcher::setSources(const QStringList &sources)
+{
+    if (d->sources == sources)
+        return;
+    d->sources = sources;
+    d->scheduleUpdate();
+    emit sourcesChanged();
+}
+
+QSize SpeedyImagePrefetcher::loadingSize() const
+{
+    return d->loadingSize;
+}
+
+void SpeedyImagePrefetcher::setLoadingSize(const QSize &size)
+{
+    if (d->loadingSize == size)
+        return;
+    // Images that were prefetched are still used if they're loaded at the same level and draw size
+    auto levelDrawSize = [](const QSize &size) {
+        return ImageTextureCache::levelDrawSize(size, ImageTextureCache::levelForSize(size));
+    };
+    bool sameLevel = d->loadingSize.isValid() && size.isValid() &&
+        ImageTextureCache::levelForSize(d->loadingSize) == ImageTextureCache::levelForSize(size) &&
+        levelDrawSize(d->loadingSize) == levelDrawSize(size);
+    d->loadingSize = size;
+    if (!sameLevel)
+        d->restart();
+    emit loadingSizeChanged();
+}
+
+QString SpeedyImagePrefetcher::loaderGroup() const
+{
+    return d->loaderGroup;
+}
+
+void SpeedyImagePrefetcher::setLoaderGroup(const QString &group)
+{
+    if (d->loaderGroup == group)
+        return;
+    d->loaderGroup = group;
+    d->restart();
+    emit loaderGroupChanged();
+}
+
+int SpeedyImagePrefetcher::priority() const
+{
+    return d->priority;
+}
+
+void SpeedyImagePrefetcher::setPriority(int priority)
+{
+    if (d->priority == priority)
+        return;
+    d->priority = priority;
+    for (auto &job : d->jobs)
+        job.setPriority(priority);
+    emit priorityChanged();
+}
+
+int SpeedyImagePrefetcher::finishedCount() const
+{
+    return int(d->finished.size());
+}
+
+qreal SpeedyImagePrefetcher::progress() const
+{
+    int total = int(d->jobs.size() + d->finished.size());
+    if (!total)
+        return d->sources.isEmpty() ? 1 : 0;
+    return qreal(d->finished.size()) / total;
+}
+
+qint64 SpeedyImagePrefetcher::loadedBytes() const
+{
+    return d->loadedBytes;
+}
+
+// Updates run from the event loop, so that setting several properties at once enqueues once
+void SpeedyImagePrefetcherPrivate::scheduleUpdate()
+{
+    if (updateScheduled)
+        return;
+    updateScheduled = true;
+    QMetaObject::invokeMethod(this, "update", Qt::QueuedConnection);
+}
+
+// Drop everything loaded so far, for a different size or loader
+void SpeedyImagePrefetcherPrivate::restart()
+{
+    QMutexLocker l(&results->mutex);
+    results->receiver = nullptr;
+    l.unlock();
+    results = std::make_shared<PrefetchResults>();
+    results->receiver = this;
+
+    for (auto &job : jobs)
+        job.cancel();
+    jobs.clear();
+    finished.clear();
+    loadedBytes = 0;
+    scheduleUpdate();
+    emit q->progressChanged();
+}
+
+void SpeedyImagePrefetcherPrivate::update()
+{
+    updateScheduled = false;
+
+    QSet<QString> wanted;
+    if (loadingSize.isValid()) {
+        for (const QString &source : sources)
+            wanted.insert(source);
+    }
+
+    // Cancel loads of sources that were removed
+    bool changed = false;
+    for (auto it = jobs.begin(); it != jobs.end(); ) {
+        if (wanted.contains(it.key())) {
+            it++;
+            continue;
+        }
+        it->cancel();
+        it = jobs.erase(it);
+        changed = true;
+    }
+    for (auto it = finished.begin(); it != finished.end(); ) {
+        if (wanted.contains(it.key())) {
+            it++;
+            continue;
+        }
+        loadedBytes -= *it;
+        it = finished.erase(it);
+        changed = true;
+    }
+
+    QStringList added;
+    for (const QString &source : sources) {
+        if (!source.isEmpty() && wanted.contains(source) && !jobs.contains(source) && !finished.contains(source)) {
+            added.append(source);
+            // Only once for duplicates
+            wanted.remove(source);
+        }
+    }
+
+    if (!added.isEmpty()) {
+        int level = ImageTextureCache::levelForSize(loadingSize);
+        QSize drawSize = ImageTextureCache::levelDrawSize(loadingSize, level);
+        qCDebug(lcPrefetch) << "prefetching" << added.size() << "images at draw size" << drawSize << "priority" << priority;
+
+        std::shared_ptr<PrefetchResults> results = this->results;
+        auto newJobs = ImageLoader::forGroup(loaderGroup)->enqueue(added, drawSize, priority,
+            [results,level](const ImageLoaderJob &job) {
+                if (job.isPreview())
+                    return;
+                qint64 bytes = -1;
+                if (job.error().isEmpty()) {
+                    QImage image = job.result();
+                    bytes = 0;
+                    if (ImageTextureCache::insertDecoded(job.path(), level, image, job.imageSize()))
+                        bytes = qint64(image.bytesPerLine()) * image.height();
+                }
+                results->add(job.path(), bytes);
+            });
+        for (int i = 0; i < added.size(); i++)
+            jobs.insert(added[i], newJobs[i]);
+        changed = true;
+    }
+
+    if (changed)
+        emit q->progressChanged();
+}
+
+void SpeedyImagePrefetcherPrivate::deliverResults()
+{
+    QMutexLocker l(&results->mutex);
+    results->scheduled = false;
+    std::vector<std::pair<QString,qint64>> batch;
+    batch.swap(results->finished);
+    l.unlock();
+
+    bool changed = false;
+    for (const auto &result : batch) {
+        // Results of loads that were cancelled as they finished are ignored
+        auto it = jobs.find(result.first);
+        if (it == jobs.end())
+            continue;
+        jobs.erase(it);
+
+        qint64 resultBytes = qMax(result.second, qint64(0));
+        finished.insert(result.first, resultBytes);
+        loadedBytes += resultBytes;
+        changed = true;
+        if (result.second < 0)
+            qCDebug(lcPrefetch) << "prefetch of" << result.first << "failed";
+    }
+
+    if (changed)
+        emit q->progressChanged();
+}
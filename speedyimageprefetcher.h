@@ -0,0 +1,69 @@
+#pragma once
+
+#include <QObject>
+#include <QSize>
+#include <QStringList>
+#include <memory>
+
+class SpeedyImagePrefetcherPrivate;
+
+// SpeedyImagePrefetcher loads images before any item shows them, for example the next few
+// photos of a slideshow. Images are loaded as a SpeedyImage with the same loadingSize and
+// loaderGroup would load them, and kept in the DecodedImageCache, so that an item showing
+// one later only needs to upload it. All new sources are enqueued on the loader at once.
+//
+// Setting sources replaces the images being prefetched: loads of sources that were removed
+// are cancelled, and sources that are still listed are not loaded again. Prefetched images
+// are evicted from the cache like any other, so prefetching more than the cache holds only
+// evicts earlier ones. Without a decoded image cache, prefetching still fills the disk cache.
+class SpeedyImagePrefetcher : public QObject
+{
+    Q_OBJECT
+    Q_PROPERTY(QStringList sources READ sources WRITE setSources NOTIFY sourcesChanged)
+    Q_PROPERTY(QSize loadingSize READ loadingSize WRITE setLoadingSize NOTIFY loadingSizeChanged)
+    Q_PROPERTY(QString loaderGroup READ loaderGroup WRITE setLoaderGroup NOTIFY loaderGroupChanged)
+    Q_PROPERTY(int priority READ priority WRITE setPriority NOTIFY priorityChanged)
+
+    Q_PROPERTY(int finishedCount READ finishedCount NOTIFY progressChanged)
+    Q_PROPERTY(qreal progress READ progress NOTIFY progressChanged)
+    Q_PROPERTY(qint64 loadedBytes READ loadedBytes NOTIFY progressChanged)
+
+public:
+    explicit SpeedyImagePrefetcher(QObject *parent = nullptr);
+    virtual ~SpeedyImagePrefetcher();
+
+    QStringList sources() const;
+    void setSources(const QStringList &sources);
+
+    // As for SpeedyImage. Nothing is loaded while it's invalid, which is the default.
+    QSize loadingSize() const;
+    void setLoadingSize(const QSize &size);
+
+    QString loaderGroup() const;
+    void setLoaderGroup(const QString &group);
+
+    // Priority of the loads. The default of -500 is below items within a few screens of
+    // the visible area, so that prefetching doesn't delay anything being shown.
+    int priority() const;
+    void setPriority(int priority);
+
+    // Sources that have finished loading, including any that failed
+    int finishedCount() const;
+    // Fraction of sources that have finished loading
+    qreal progress() const;
+    // Bytes of decoded images inserted into the cache for the current sources, counted as
+    // each finished loading. Images the cache has evicted since are still counted, so this
+    // is not what the cache holds now.
+    qint64 loadedBytes() const;
+
+signals:
+    void sourcesChanged();
+    void loadingSizeChanged();
+    void loaderGroupChanged();
+    void priorityChanged();
+    void progressChanged();
+
+private:
+    friend class SpeedyImagePrefetcherPrivate;
+    std::unique_ptr<SpeedyImagePrefetcherPrivate> d;
+};
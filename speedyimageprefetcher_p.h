@@ -0,0 +1,50 @@
+#pragma once
+
+#include "speedyimageprefetcher.h"
+#include "imageloader.h"
+#include <QHash>
+#include <QMutex>
+#include <vector>
+
+// Results of loads, shared with their callbacks, which may run after the prefetcher is
+// gone. Delivery to the prefetcher is scheduled once for all results queued until it runs.
+struct PrefetchResults
+{
+    QMutex mutex;
+    SpeedyImagePrefetcherPrivate *receiver = nullptr;
+    bool scheduled = false;
+    // Finished sources with the bytes of their image inserted into the cache, or -1 if it failed
+    std::vector<std::pair<QString,qint64>> finished;
+
+    void add(const QString &source, qint64 bytes);
+};
+
+class SpeedyImagePrefetcherPrivate : public QObject
+{
+    Q_OBJECT
+
+public:
+    SpeedyImagePrefetcherPrivate(SpeedyImagePrefetcher *q);
+    ~SpeedyImagePrefetcherPrivate();
+
+    SpeedyImagePrefetcher *q;
+
+    QStringList sources;
+    QSize loadingSize;
+    QString loaderGroup;
+    int priority;
+
+    std::shared_ptr<PrefetchResults> results;
+    // Loads of sources that haven't finished, and finished sources with their bytes
+    QHash<QString,ImageLoaderJob> jobs;
+    QHash<QString,qint64> finished;
+    qint64 loadedBytes;
+    bool updateScheduled;
+
+    void scheduleUpdate();
+    void restart();
+
+public slots:
+    void update();
+    void deliverResults();
+};
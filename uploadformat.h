@@ -0,0 +1,45 @@
+#pragma once
+
+#include <QImage>
+
+// Pixel formats that the scene graph uploads to textures without converting. Opaque and
+// alpha formats have the same memory layout, with alpha always 0xFF in the opaque format.
+// Decoders produce these formats directly where they can, and everything else is
+// converted on the loader's worker threads by convertToUploadFormat.
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+static const QImage::Format opaqueUploadFormat = QImage::Format_RGBX8888;
+static const QImage::Format alphaUploadFormat = QImage::Format_RGBA8888_Premultiplied;
+#else
+static const QImage::Format opaqueUploadFormat = QImage::Format_RGB32;
+static const QImage::Format alphaUploadFormat = QImage::Format_ARGB32_Premultiplied;
+#endif
+
+// Returns true if every pixel of an image in alphaUploadFormat is opaque
+inline bool isFullyOpaque(const QImage &image)
+{
+    const int alphaOffset = (alphaUploadFormat == QImage::Format_RGBA8888_Premultiplied || Q_BYTE_ORDER == Q_LITTLE_ENDIAN) ? 3 : 0;
+    for (int y = 0; y < image.height(); y++) {
+        const uchar *p = image.constScanLine(y) + alphaOffset;
+        for (int x = 0; x < image.width(); x++, p += 4) {
+            if (*p != 0xFF)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Convert image to the upload format for the scene graph. Images with an alpha channel
+// that turn out to be fully opaque are given the opaque format, so that they can be
+// drawn without blending.
+inline QImage convertToUploadFormat(const QImage &image)
+{
+    if (image.isNull() || image.format() == opaqueUploadFormat)
+        return image;
+
+    QImage result = image;
+    if (result.format() != alphaUploadFormat)
+        result = result.convertToFormat(result.hasAlphaChannel() ? alphaUploadFormat : opaqueUploadFormat);
+    if (result.format() == alphaUploadFormat && isFullyOpaque(result))
+        result.reinterpretAsFormat(opaqueUploadFormat);
+    return result;
+}